@@ -0,0 +1,273 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Times the archive operations on synthetic archives of a few shapes.
+// Every run of an operation happens in a child process of its own, so the
+// peak RSS reported is that of the operation alone, less what the child
+// inherited from the bench. Times are the best of the rounds, RSS the
+// highest.
+// Usage: lbr_bench [-c CASE]... [-r ROUNDS] [-j JOBS] [-q] [-w WORKDIR]
+//   CASE is small, medium or large, all of them by default; -q makes every
+//   case a tenth of its size.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "synth.h"
+
+struct BenchCase {
+	const char * name;
+	SynthSpec spec;
+};
+
+static std::vector<BenchCase> all_cases() {
+	std::vector<BenchCase> cases(3);
+	cases[0].name = "small"; // many tiny entries, directory bound
+	cases[0].spec.count = 10000;
+	cases[0].spec.min_size = 0;
+	cases[0].spec.max_size = 4096;
+	cases[0].spec.deleted = 0.1;
+	cases[1].name = "medium"; // mixed sizes
+	cases[1].spec.count = 1000;
+	cases[1].spec.min_size = 1024;
+	cases[1].spec.max_size = 1024*1024;
+	cases[1].spec.dist = SizeDist::Log;
+	cases[1].spec.deleted = 0.05;
+	cases[2].name = "large"; // few big entries, copy bound
+	cases[2].spec.count = 32;
+	cases[2].spec.min_size = 1024*1024;
+	cases[2].spec.max_size = 8*1024*1024;
+	return cases;
+}
+
+struct Result {
+	double ms = 0;
+	long rss_kib = 0;
+	bool ok = false;
+};
+
+// Runs op in a child process and collects its time and peak RSS. A child
+// starts out with the pages of the bench it shares counted in, so what it
+// had right after the fork is taken off.
+static Result run_child(const std::function<int()> & op) {
+	Result r;
+	int fds[2];
+	if (pipe(fds) != 0) return r;
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return r;
+	}
+	struct Report {
+		long base_kib;
+		double ms;
+	};
+	if (pid == 0) {
+		close(fds[0]);
+		Report rep;
+		struct rusage ru;
+		rep.base_kib = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+		auto start = std::chrono::steady_clock::now();
+		int res = op();
+		std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+		rep.ms = d.count();
+		bool ok = write(fds[1], &rep, sizeof(rep)) == sizeof(rep);
+		_exit(res == LBR_OK && ok ? 0 : 1);
+	}
+	close(fds[1]);
+	Report rep;
+	bool got = read(fds[0], &rep, sizeof(rep)) == sizeof(rep);
+	close(fds[0]);
+	int status = 0;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) != pid) return r;
+	r.ms = rep.ms;
+	r.rss_kib = std::max(0L, ru.ru_maxrss - rep.base_kib);
+	r.ok = got && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	return r;
+}
+
+static void report(const char * bench_case, const char * op, double units, const char * unit, const Result & r) {
+	std::cout << std::left << std::setw(8) << bench_case << std::setw(12) << op << std::right;
+	if (!r.ok) {
+		std::cout << "  failed" << std::endl;
+		return;
+	}
+	double rate = units / (r.ms / 1000.0);
+	std::cout << std::fixed << std::setprecision(2) << std::setw(12) << r.ms << " ms"
+		<< std::setw(12) << rate << " " << std::left << std::setw(10) << unit << std::right
+		<< std::setw(10) << r.rss_kib << " KiB" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> wanted;
+	int rounds = 3;
+	bool quick = false;
+	std::string work;
+	LbrOptions opts;
+	int optc;
+	while ((optc = getopt(argc, argv, "c:r:j:qw:h")) != -1)
+		switch (optc) {
+			case 'c':
+				wanted.push_back(optarg);
+				break;
+			case 'r':
+				rounds = std::max(1, atoi(optarg));
+				break;
+			case 'j':
+				opts.jobs = std::max(1, atoi(optarg));
+				break;
+			case 'q':
+				quick = true;
+				break;
+			case 'w':
+				work = optarg;
+				break;
+			default:
+				std::cout << "Usage: lbr_bench [-c CASE]... [-r ROUNDS] [-j JOBS] [-q] [-w WORKDIR]" << std::endl;
+				return optc == 'h' ? 0 : 1;
+		}
+	bool own_work = work.empty();
+	if (own_work) {
+		char tmpl[] = "/tmp/lbr-bench.XXXXXX";
+		if (!mkdtemp(tmpl)) {
+			std::cout << "Error creating work directory." << std::endl;
+			return 1;
+		}
+		work = tmpl;
+	}
+	LbrOptionsScope scope(opts);
+	namespace fs = std::filesystem;
+
+	std::cout << "case    op                  time        rate              peak RSS" << std::endl;
+	for (auto & c : all_cases()) {
+		if (!wanted.empty() && std::find(wanted.begin(), wanted.end(), c.name) == wanted.end())
+			continue;
+		if (quick)
+			c.spec.count = std::max<size_t>(1, c.spec.count / 10);
+		std::string dir = work + "/" + c.name;
+		std::vector<std::string> paths;
+		if (!synth_files(dir + "/files", c.spec, paths)) {
+			std::cout << "Error writing files for " << c.name << std::endl;
+			return 1;
+		}
+		// The archive everything but build works on has the deleted
+		// entries of the spec too, build only sees the files.
+		const std::string archive = dir + "/a.lbr";
+		const std::string built = dir + "/b.lbr";
+		const std::string edited = dir + "/e.lbr";
+		const std::string extra = paths.empty() ? "" : paths[paths.size() / 2];
+
+		// Runs op rounds times, setup first each time, outside the timing.
+		auto bench = [&](const char * op_name, double units, const char * unit,
+			std::function<void()> setup, std::function<int()> op) {
+			Result best;
+			for (int r = 0; r < rounds; ++r) {
+				if (setup) setup();
+				Result res = run_child(op);
+				if (!res.ok) {
+					best.ok = false;
+					break;
+				}
+				if (!best.ok || res.ms < best.ms) best.ms = res.ms;
+				best.rss_kib = std::max(best.rss_kib, res.rss_kib);
+				best.ok = true;
+			}
+			report(c.name, op_name, units, unit, best);
+		};
+
+		auto build = [&]() { return build_lbr(built, paths, false, false, false); };
+		if (!synth_archive(archive, c.spec) || build() != LBR_OK) {
+			std::cout << "Error building " << archive << std::endl;
+			return 1;
+		}
+		LbrArchive reference(opts);
+		if (reference.open(archive) != LBR_OK) return 1;
+		uint64_t size = fs::file_size(archive);
+		uint64_t dir_size = reference.index().data_start;
+		uint64_t entries = reference.list().size();
+		const double mb = 1024.0 * 1024.0;
+		// A live entry from the middle of the archive, to edit.
+		std::string target;
+		for (size_t i = entries / 2; i < entries && target.empty(); ++i) {
+			if (reference.list()[i].type != "D") target = reference.list()[i].ascii_name;
+		}
+		std::vector<std::string> lookups;
+		std::mt19937 rng(c.spec.seed);
+		for (size_t i = 0; i < 10000 && entries > 0; ++i)
+			lookups.push_back(reference.list()[rng() % entries].ascii_name);
+		reference.close();
+		auto fresh_copy = [&]() {
+			fs::copy_file(archive, edited, fs::copy_options::overwrite_existing);
+		};
+
+		bench("build", fs::file_size(built) / mb, "MiB/s", nullptr, build);
+		bench("list", entries, "entries/s", nullptr, [&]() {
+			LbrArchive a(opts);
+			int res = a.open(archive);
+			uint64_t sum = 0;
+			for (const auto & f : a.list())
+				sum += f.length + f.ascii_name.size();
+			return res == LBR_OK && sum > 0 ? LBR_OK : LBR_READ_ERROR;
+		});
+		bench("find", lookups.size(), "lookups/s", nullptr, [&]() {
+			LbrArchive a(opts);
+			int res = a.open(archive);
+			for (const auto & name : lookups) {
+				if (!a.find(name)) res = LBR_NOT_FOUND;
+			}
+			return res;
+		});
+		bench("extract", size / mb, "MiB/s", [&]() {
+			fs::remove_all(dir + "/x");
+			fs::create_directories(dir + "/x");
+		}, [&]() { return extract_lbr(archive, dir + "/x", {}, false, false, false); });
+		bench("chtype", size / mb, "MiB/s", fresh_copy, [&]() {
+			return chtype_lbr(edited, target, "U", false);
+		});
+		bench("chtype-grow", size / mb, "MiB/s", fresh_copy, [&]() {
+			return chtype_lbr(edited, target, "USR", false);
+		});
+		bench("delete", size / mb, "MiB/s", fresh_copy, [&]() {
+			return delete_lbr(edited, target, false, false);
+		});
+		bench("wipe", size / mb, "MiB/s", fresh_copy, [&]() {
+			return delete_lbr(edited, target, false, true);
+		});
+		bench("add", size / mb, "MiB/s", fresh_copy, [&]() {
+			return add_lbr(edited, {extra}, false);
+		});
+		std::cout << std::left << std::setw(8) << c.name << entries << " entries, "
+			<< size << " bytes, directory " << dir_size << " bytes" << std::endl;
+	}
+	if (own_work)
+		fs::remove_all(work);
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Writes a synthetic archive, or the files one would be built from.
+// Usage: lbr_gen [OPTIONS] OUTPUT
+//   -n COUNT     number of entries (default 1000)
+//   -s MIN:MAX   entry sizes in bytes (default 0:4096)
+//   -L           log-uniform sizes instead of uniform
+//   -d RATIO     share of entries marked as deleted, 0 to 1 (default 0)
+//   -S SEED      seed (default 1)
+//   -F           write one file per entry into the directory OUTPUT instead
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include "synth.h"
+
+static void usage() {
+	std::cout << "Usage: lbr_gen [-n COUNT] [-s MIN:MAX] [-L] [-d RATIO] [-S SEED] [-F] OUTPUT" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+	SynthSpec spec;
+	bool files = false;
+	int optc;
+	while ((optc = getopt(argc, argv, "n:s:Ld:S:Fh")) != -1)
+		switch (optc) {
+			case 'n':
+				spec.count = strtoull(optarg, NULL, 10);
+				break;
+			case 's':
+			{
+				std::string str(optarg);
+				size_t cln = str.find(':');
+				if (cln == std::string::npos) {
+					usage();
+					return 1;
+				}
+				spec.min_size = strtoull(str.substr(0, cln).c_str(), NULL, 10);
+				spec.max_size = strtoull(str.substr(cln + 1).c_str(), NULL, 10);
+				if (spec.max_size < spec.min_size) {
+					std::cout << "Invalid sizes: " << optarg << std::endl;
+					return 1;
+				}
+				break;
+			}
+			case 'L':
+				spec.dist = SizeDist::Log;
+				break;
+			case 'd':
+				spec.deleted = atof(optarg);
+				break;
+			case 'S':
+				spec.seed = strtoul(optarg, NULL, 10);
+				break;
+			case 'F':
+				files = true;
+				break;
+			default:
+				usage();
+				return optc == 'h' ? 0 : 1;
+		}
+	if (optind + 1 != argc) {
+		usage();
+		return 1;
+	}
+	std::string out = argv[optind];
+	LbrOptions opts;
+	opts.log = &std::cout;
+	LbrOptionsScope scope(opts);
+	std::vector<std::string> paths;
+	if (files ? !synth_files(out, spec, paths) : !synth_archive(out, spec)) {
+		std::cout << "Error writing " << out << std::endl;
+		return 1;
+	}
+	return 0;
+}
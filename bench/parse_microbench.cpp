@@ -0,0 +1,100 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Google Benchmark micro-benchmarks of parse_directory on well formed
+// directories and on the worst inputs it can be handed: a huge count over
+// little data, no delimiters at all so that one name takes all of the
+// input, every length bad, and nothing but the smallest entries. Each
+// runs over a range of input sizes and fits its complexity, which has to
+// come out as O(N). The "index_bytes" counter is the memory the index
+// took per input byte.
+
+#include <string>
+#include <benchmark/benchmark.h>
+#include "../liblbr.h"
+
+static std::string entry(size_t i, const std::string & length) {
+	return "F" + std::to_string(i) + ".PRG\rP\r " + length + " \r";
+}
+
+// A well formed directory of n entries.
+static std::string good_directory(size_t n) {
+	std::string dir = "DWB " + std::to_string(n) + " \r";
+	for (size_t i = 0; i < n; ++i)
+		dir += entry(i, std::to_string(i % 5000));
+	return dir;
+}
+
+// The largest count there is, over n well formed entries.
+static std::string huge_count(size_t n) {
+	std::string dir = "DWB 18446744073709551615 \r";
+	for (size_t i = 0; i < n; ++i)
+		dir += entry(i, "1");
+	return dir;
+}
+
+// n bytes with no delimiter in them after the header.
+static std::string no_delimiters(size_t n) {
+	return "DWB 1000000 \r" + std::string(n, 'A');
+}
+
+// Every entry with a length that does not parse, or is over the limit.
+static std::string bad_lengths(size_t n) {
+	std::string dir = "DWB " + std::to_string(n) + " \r";
+	for (size_t i = 0; i < n; ++i)
+		dir += entry(i, i % 2 ? "x1" : "99999999999999999999");
+	return dir;
+}
+
+// The smallest entries there are, five bytes each.
+static std::string tiny_entries(size_t n) {
+	std::string dir = "DWB " + std::to_string(n) + " \r";
+	for (size_t i = 0; i < n; ++i)
+		dir += "\r\r  \r";
+	return dir;
+}
+
+static void run(benchmark::State & state, std::string (*make)(size_t)) {
+	static const LbrOptions opts;
+	LbrOptionsScope scope(opts);
+	std::string in = make(state.range(0));
+	size_t index_bytes = 0;
+	for (auto _ : state) {
+		LbrIndex index;
+		bool ok = parse_directory(in, index);
+		benchmark::DoNotOptimize(ok);
+		index_bytes = index.files.capacity() * sizeof(FileEntry);
+		for (const auto & f : index.files)
+			index_bytes += f.name.capacity() + f.ascii_name.capacity() + f.type.capacity();
+	}
+	state.SetBytesProcessed(int64_t(state.iterations()) * in.size());
+	state.SetComplexityN(in.size());
+	state.counters["index_bytes"] = double(index_bytes) / in.size();
+}
+
+#define PARSE_BENCHMARK(make, lo, hi) \
+	BENCHMARK_CAPTURE(run, make, make)->RangeMultiplier(4)->Range(lo, hi)->Complexity(benchmark::oN)
+
+PARSE_BENCHMARK(good_directory, 64, 64 << 10);
+PARSE_BENCHMARK(huge_count, 64, 64 << 10);
+PARSE_BENCHMARK(no_delimiters, 1 << 10, 16 << 20);
+PARSE_BENCHMARK(bad_lengths, 64, 64 << 10);
+PARSE_BENCHMARK(tiny_entries, 64, 256 << 10);
+
+BENCHMARK_MAIN();
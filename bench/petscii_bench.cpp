@@ -0,0 +1,102 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Times the PETSCII -> ASCII conversion of a directory's worth of names:
+// the old per-character code, the lookup table alone, and the full kernel
+// (table plus vector path for long names).
+// Usage: petscii_bench [ENTRIES] [ROUNDS]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "../petscii.h"
+
+// The conversion as it was before the tables, less a branch for 0xC1 to
+// 0xCA that a signed char never took.
+static std::string legacy_petscii2ascii(std::string petscii) {
+	std::string ascii;
+	for (const char & c : petscii) {
+		if (c < 0x20) // ' '
+			ascii += '?';
+		else if (c >= 0x61 && c <= 0x7A)
+			ascii += c - 0x20;
+		else if (c == 0x5B || c == 0x5D)
+			ascii += c;
+		else if(c > 0x5A) { // 'Z'
+			ascii += '?';
+		} else
+			ascii += c;
+	}
+	return ascii;
+}
+
+template <typename F>
+static double time_ms(int rounds, F f) {
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; ++r)
+		f();
+	std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+	return d.count() / rounds;
+}
+
+int main(int argc, char *argv[]) {
+	size_t entries = argc > 1 ? std::atol(argv[1]) : 100000;
+	int rounds = argc > 2 ? std::atoi(argv[2]) : 20;
+
+	// Mostly 16 character disk names, with some long ones mixed in.
+	std::mt19937 rng(64);
+	std::vector<std::string> names(entries);
+	for (auto & n : names) {
+		size_t len = rng() % 8 == 0 ? 16 + rng() % 48 : 1 + rng() % 16;
+		for (size_t i = 0; i < len; ++i)
+			n += static_cast<char>(0x20 + rng() % 0x60);
+	}
+	std::vector<std::string> out(entries);
+	size_t bytes = 0;
+	for (const auto & n : names)
+		bytes += n.size();
+
+	double legacy = time_ms(rounds, [&]() {
+		for (size_t i = 0; i < entries; ++i)
+			out[i] = legacy_petscii2ascii(names[i]);
+	});
+	double table = time_ms(rounds, [&]() {
+		for (size_t i = 0; i < entries; ++i) {
+			const std::string & n = names[i];
+			out[i].resize(n.size());
+			for (size_t j = 0; j < n.size(); ++j)
+				out[i][j] = petscii2ascii_table[static_cast<unsigned char>(n[j])];
+		}
+	});
+	double kernel = time_ms(rounds, [&]() {
+		for (size_t i = 0; i < entries; ++i) {
+			out[i].resize(names[i].size());
+			petscii2ascii(names[i].data(), names[i].size(), &out[i][0]);
+		}
+	});
+
+	std::cout << entries << " names, " << bytes << " bytes, mean of " << rounds << " rounds" << std::endl;
+	std::cout << "legacy: " << legacy << " ms" << std::endl;
+	std::cout << "table:  " << table << " ms (" << legacy / table << "x)" << std::endl;
+	std::cout << "kernel: " << kernel << " ms (" << legacy / kernel << "x)" << std::endl;
+	return 0;
+}
@@ -0,0 +1,145 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Synthetic archives for the benchmarks: entry names, sizes and deleted
+// entries drawn from a seeded generator, so every run sees the same data.
+
+#ifndef LBR_BENCH_SYNTH_H
+#define LBR_BENCH_SYNTH_H
+
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../liblbr.h"
+
+enum class SizeDist {
+	Uniform, // every size between min and max equally likely
+	Log // log-uniform, mostly small entries and a few big ones
+};
+
+struct SynthSpec {
+	size_t count = 1000;
+	uint64_t min_size = 0;
+	uint64_t max_size = 4096;
+	SizeDist dist = SizeDist::Uniform;
+	double deleted = 0.0; // share of entries marked as deleted
+	unsigned seed = 1;
+};
+
+struct SynthEntry {
+	std::string name;
+	std::string type;
+	uint64_t length = 0; // 0 for deleted entries
+};
+
+// Names look like "F000123.PRG" / ".SEQ", numbered in order.
+static inline std::vector<SynthEntry> synth_entries(const SynthSpec & spec) {
+	std::mt19937_64 rng(spec.seed);
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	std::vector<SynthEntry> entries(spec.count);
+	for (size_t i = 0; i < spec.count; ++i) {
+		SynthEntry & e = entries[i];
+		char name[32];
+		bool prg = rng() & 1;
+		snprintf(name, sizeof(name), "F%06zu.%s", i, prg ? "PRG" : "SEQ");
+		e.name = name;
+		e.type = prg ? "P" : "S";
+		if (unit(rng) < spec.deleted) {
+			e.type = "D";
+			continue;
+		}
+		double u = unit(rng);
+		if (spec.dist == SizeDist::Log) {
+			double lo = std::log(double(spec.min_size) + 1), hi = std::log(double(spec.max_size) + 1);
+			e.length = uint64_t(std::exp(lo + u * (hi - lo))) - 1;
+		} else
+			e.length = spec.min_size + uint64_t(u * double(spec.max_size - spec.min_size));
+		e.length = std::min(std::max(e.length, spec.min_size), spec.max_size);
+		if (e.length == 0) e.type = "D";
+	}
+	return entries;
+}
+
+// Fills buf with bytes that depend on the entry and the position, cheap
+// to make and not all the same.
+static inline void synth_fill(char * buf, size_t len, uint64_t entry, uint64_t pos) {
+	uint64_t x = entry * 0x9E3779B97F4A7C15ull + pos;
+	for (size_t i = 0; i < len; ++i) {
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		buf[i] = char(x);
+	}
+}
+
+// Writes the archive in one go through LbrWriter.
+static inline bool synth_archive(const std::string & path, const SynthSpec & spec) {
+	LbrWriter writer(path);
+	auto entries = synth_entries(spec);
+	for (size_t i = 0; i < entries.size(); ++i) {
+		const SynthEntry & e = entries[i];
+		if (e.length == 0) {
+			writer.add_deleted(e.name);
+			continue;
+		}
+		uint64_t done = 0;
+		bool ok = writer.add_generated(e.name, [&](char * buf, size_t len) {
+			size_t n = std::min<uint64_t>(len, e.length - done);
+			synth_fill(buf, n, i, done);
+			done += n;
+			return (ssize_t)n;
+		}, e.type);
+		if (!ok) return false;
+	}
+	return writer.finish();
+}
+
+// Writes every non-deleted entry as its own file in dir, made if need be,
+// for building archives from. Returns the paths in entry order.
+static inline bool synth_files(const std::string & dir, const SynthSpec & spec, std::vector<std::string> & paths) {
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	if (ec) return false;
+	std::vector<char> buf(1 << 20);
+	auto entries = synth_entries(spec);
+	for (size_t i = 0; i < entries.size(); ++i) {
+		const SynthEntry & e = entries[i];
+		if (e.length == 0) continue;
+		std::string path = dir + "/" + e.name;
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) return false;
+		for (uint64_t done = 0; done < e.length; ) {
+			size_t n = std::min<uint64_t>(buf.size(), e.length - done);
+			synth_fill(buf.data(), n, i, done);
+			if (write(fd, buf.data(), n) != (ssize_t)n) {
+				close(fd);
+				return false;
+			}
+			done += n;
+		}
+		close(fd);
+		paths.push_back(path);
+	}
+	return true;
+}
+
+#endif
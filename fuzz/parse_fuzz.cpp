@@ -0,0 +1,86 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// libFuzzer target for parse_directory, the one parser every reader of
+// archives goes through. Besides not crashing, the index it returns has
+// to stay within the input: no more entries than fit in it, every
+// directory entry inside it and in order, and payload offsets the
+// running sum of the lengths before them.
+// Built with LBR_FUZZ_STANDALONE it has a main() that runs the target once
+// on every file given, for compilers without libFuzzer.
+
+#include <cstdint>
+#include <cstdlib>
+#include <string_view>
+#include "../liblbr.h"
+
+#define FUZZ_CHECK(cond) do { if (!(cond)) abort(); } while (0)
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+	static const LbrOptions opts;
+	LbrOptionsScope scope(opts);
+	std::string_view in(reinterpret_cast<const char *>(data), size);
+	LbrIndex index;
+	if (!parse_directory(in, index))
+		return 0;
+	// The smallest entry is five bytes, so memory is bounded by the input.
+	FUZZ_CHECK(index.files.size() <= index.count);
+	FUZZ_CHECK(index.files.size() <= size / 5 + 1);
+	FUZZ_CHECK(index.files.capacity() <= 2 * (size / 5 + 1));
+	FUZZ_CHECK(index.dir_start <= size && index.data_start <= size);
+	uint64_t pos = index.dir_start;
+	uint64_t offset = index.data_start;
+	for (const auto & f : index.files) {
+		FUZZ_CHECK(f.dir_offset == pos);
+		FUZZ_CHECK(f.dir_offset + f.dir_length <= size);
+		FUZZ_CHECK(f.name.size() + f.type.size() <= f.dir_length);
+		FUZZ_CHECK(f.ascii_name.size() == f.name.size());
+		FUZZ_CHECK(f.offset == offset);
+		pos += f.dir_length;
+		offset += f.length;
+	}
+	FUZZ_CHECK(pos == index.data_start);
+	FUZZ_CHECK(index.truncated || index.files.size() == index.count);
+	// Sorting is the next thing listings do with what came out.
+	std::vector<FileEntry> sorted = index.files;
+	sort_numerically(sorted);
+	for (size_t i = 1; i < sorted.size(); ++i)
+		FUZZ_CHECK(!num_cmp(sorted[i], sorted[i - 1]));
+	return 0;
+}
+
+#ifdef LBR_FUZZ_STANDALONE
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+	for (int i = 1; i < argc; ++i) {
+		std::ifstream in(argv[i], std::ios::binary);
+		if (!in) {
+			std::cout << "File not found: " << argv[i] << std::endl;
+			return 1;
+		}
+		std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+	}
+	return 0;
+}
+#endif
@@ -20,15 +20,15 @@
 #include <string>
 #include <iostream>
 #include <filesystem> // c++17
-#include <fstream>
 #include <algorithm>
 #include <vector>
+#include <chrono>
 #include <unistd.h>
 #include <getopt.h>
+#include "liblbr.h"
 
-const int MAX_SANE_LENGTH = 1024*1024;
-static bool verbose = false;
-static bool convert_petscii = true;
+// Everything the options below set for the library.
+static LbrOptions options;
 
 static struct option long_options[] = {
 	{"sort",          no_argument, NULL, 'n'},
@@ -37,603 +37,171 @@ static struct option long_options[] = {
 	{"skip-deleted",  no_argument, NULL, 'b'},
 	{"add-extension", no_argument, NULL, 'X'},
 	{"no-conversion", no_argument, NULL, 'P'},
+	{"max-length",   required_argument, NULL, 'M'},
+	{"in-place",      no_argument, NULL, 'I'},
+	{"index-cache",   no_argument, NULL, 'i'},
+	{"dedup",         no_argument, NULL, 'D'},
+	{"dedup-skip",    no_argument, NULL, 'K'},
 	{"append",        no_argument, NULL, 'a'},
 	{"list",          no_argument, NULL, 'l'},
+	{"recursive",     no_argument, NULL, 'r'},
+	{"find",         required_argument, NULL, 'f'},
 	{"create",        no_argument, NULL, 'c'},
 	{"extract",       no_argument, NULL, 'e'},
 	{"extract-into", required_argument, NULL, 'E'},
+	{"to-stdout",    required_argument, NULL, 'O'},
+	{"cat",          required_argument, NULL, 'k'},
 	{"delete",       required_argument, NULL, 'd'},
 	{"wipe",         required_argument, NULL, 'w'},
 	{"type",         required_argument, NULL, 't'},
+	{"batch",        required_argument, NULL, 'B'},
+	{"compact",      optional_argument, NULL, 'C'},
+	{"verify",       optional_argument, NULL, 'y'},
+	{"sync",         optional_argument, NULL, 'u'},
 	{"help",       no_argument, NULL, 'h'},
 	{"version",    no_argument, NULL, 'V'},
 	{"verbose",    no_argument, NULL, 'v'},
+	{"jobs",       required_argument, NULL, 'j'},
+	{"stats",      optional_argument, NULL, 'S'},
 	{NULL, 0, NULL, 0}
 };
 
-struct FileEntry {
-	std::string name;
-	std::string path;
-	unsigned int length;
-	std::string type;
-	bool bad_length;
-};
-
-static std::string petscii2ascii(std::string petscii) {
-	// Note: this is a very conservative conversion
-	if (!convert_petscii) return petscii;
-	std::string ascii;
-	for (const char & c : petscii) {
-		if (c < 0x20) // ' '
-			ascii += '?';
-		else if (c >= 0x61 && c <= 0x7A)
-			ascii += c - 0x20;
-		else if (c >= 0xC1 && c <= 0xCA)
-			ascii += c - 0x80;
-		else if (c == 0x5B || c == 0x5D)
-			ascii += c;
-		else if(c > 0x5A) { // 'Z'
-			ascii += '?';
-		} else
-			ascii += c;
-	}
-	return ascii;
-}
-
-static std::string ascii2petscii(std::string ascii) {
-	// Note: this is a very conservative conversion
-	if (!convert_petscii) return ascii;
-	std::string petscii;
-	for (const char & c : ascii) {
-		if (c < 0x20) // ' '
-			petscii += '?';
-		else if (c == 0x5C) // backslash
-			petscii += '/';
-		else if (c == 0x5F) // under_score
-			petscii += ' ';
-		else if (c == 0x60) // backtick
-			petscii += 0x27; // apostrophe
-		else if (c >= 0x61 && c <= 0x7A) // lower case
-			petscii += c - 0x20;
-		else if (c == 0x7B) // curly open
-			petscii += '(';
-		else if (c == 0x7D) // curly close
-			petscii += ')';
-		else if (c == 0x7C) // pipe
-			petscii += '/';
-		else if (c > 0x7C)
-			petscii += '?';
-		else
-			petscii += c;
-	}
-	return petscii;
-}
-
-static bool num_cmp(const FileEntry & i,const FileEntry & j) {
-	if (i.name.length() < j.name.length())
-		return true;
-	if (i.name.length() > j.name.length())
-		return false;
-	return i.name.compare(j.name) < 0;
-}
-
-int build_lbr(std::string outfile, std::vector<std::string> input,
-	bool numerical_sort, bool numerical_padding, bool strip_extension) {
-
-	std::vector<FileEntry> files;
-	for (const auto & i : input) {
-		std::filesystem::path path(i);
-		FileEntry f;
-		f.name = path.filename();
-		f.path = i;
-		f.length = std::filesystem::file_size(path);
-		files.push_back(f);
-	}
-	if (numerical_sort) {
-		std::sort(files.begin(), files.end(), num_cmp);
-		if (numerical_padding) {
-			std::string f_str = files.front().name;
-			int first = std::atoi(f_str.c_str());
-			std::string l_str = files.back().name;
-			int last = std::atoi(l_str.c_str());
-			if (last <= first) {
-				std::cout << "Error. unable to pad.";
-				return 1;
-			}
-			for(int i = first; i < last; i++) {
-				std::string c_str = files[i-first].name;
-				int cur = std::atoi(c_str.c_str());
-				while(i < cur) {
-					FileEntry f;
-					f.name = std::to_string(i);
-					f.length = 0;
-					files.insert(files.begin()+(i-first),f);
-					++i;
-				}
-			}
-		}
-	}
-	std::ofstream out(outfile, std::ofstream::binary);
-	out << "DWB" << " ";
-	out << files.size() << " ";
-	out.put(0x0D);
-	for (const auto & a : files) {
-		if (verbose)
-			std::cout << "+ " << a.name;
-		std::string ext = std::filesystem::path(a.name).extension();
-		std::transform(ext.begin(), ext.end(), ext.begin(),
-			[](auto c){ return std::tolower(c); });
-		if (strip_extension) {
-			size_t dot = a.name.find_last_of(".");
-			if (dot == std::string::npos)
-				out << ascii2petscii(a.name);
-			else
-				out << ascii2petscii(a.name.substr(0, dot));
-		} else
-			out << ascii2petscii(a.name);
-		out.put(0x0D);
-		if (a.length == 0)
-			out.put('D');
-		else {
-			if (ext == ".prg")
-				out.put('P');
-			else if (ext == ".usr")
-				out.put('U');
-			else if (ext == ".rel")
-				out.put('R');
-			else
-				out.put('S');
+// Prints what each phase took, as a table or as a single JSON object.
+static void print_stats(std::ostream & out, const LbrStats & stats, double total_ms, bool json) {
+	auto ms = [](const LbrPhaseStats & p) { return p.nanoseconds / 1e6; };
+	if (json) {
+		out << "{\"total_ms\":" << total_ms << ",\"phases\":{";
+		for (int i = 0; i < LBR_PHASE_COUNT; ++i) {
+			const LbrPhaseStats & p = stats.phase[i];
+			out << (i ? "," : "") << "\"" << lbr_phase_name(i) << "\":{\"ms\":" << ms(p)
+				<< ",\"bytes_read\":" << p.bytes_read << ",\"reads\":" << p.reads
+				<< ",\"bytes_written\":" << p.bytes_written << ",\"writes\":" << p.writes << "}";
 		}
-		out.put(0x0D);
-		out << " " << a.length << " ";
-		out.put(0x0D);
-	}
-	for (const auto & f : files) {
-		if (f.length == 0) continue;
-		std::ifstream infile(f.path, std::ifstream::binary);
-		char* buffer = new char[f.length];
-		infile.read(buffer, f.length);
-		out.write(buffer, f.length);
-		delete[] buffer;
-	}
-	out.close();
-	return 0;
+		out << "}}" << std::endl;
+		return;
+	}
+	char line[160];
+	snprintf(line, sizeof(line), "%-8s %12s %14s %8s %14s %8s", "phase", "ms", "bytes read", "reads", "bytes written", "writes");
+	out << line << std::endl;
+	for (int i = 0; i < LBR_PHASE_COUNT; ++i) {
+		const LbrPhaseStats & p = stats.phase[i];
+		snprintf(line, sizeof(line), "%-8s %12.3f %14llu %8llu %14llu %8llu", lbr_phase_name(i), ms(p),
+			(unsigned long long)p.bytes_read, (unsigned long long)p.reads,
+			(unsigned long long)p.bytes_written, (unsigned long long)p.writes);
+		out << line << std::endl;
+	}
+	snprintf(line, sizeof(line), "%-8s %12.3f", "total", total_ms);
+	out << line << std::endl;
 }
 
-int extract_lbr(std::string infile, std::string dest_folder, std::vector<std::string> targets, bool skip_deleted, bool add_extension) {
-	std::ifstream in(infile, std::ifstream::binary);
-	char signature[3];
-	in.read(signature, 3);
-	if (signature[0] != 'D' || signature[1] != 'W' || signature[2] != 'B') {
-		in.close();
-		std::cout << "Error: invalid signature, not an LBR file?" << std::endl;
-		return 1;
-	}
-	in.ignore(1); // space
-	char count[256];
-	in.get(count, 256, 0x20);
-	in.ignore(1); // space
-	in.ignore(1); // cr
-	std::vector<FileEntry> files;
-	int file_count = atoi(count);
-	for (int i = 0; i < file_count; ++i) {
-		// TODO: error handling
-		char name[256];
-		in.get(name, 256, 0x0D);
-		in.ignore(1);
-		char type[256];
-		in.get(type, 256, 0x0D);
-		in.ignore(1); // cr
-		in.ignore(1); // space
-		char length[256];
-		in.get(length, 256, 0x20);
-		in.ignore(1); // space
-		in.ignore(1); // cr
-		FileEntry f;
-		f.name = name;
-		int len = atoi(length);
-		if (len < 0 || len > MAX_SANE_LENGTH) {
-			f.bad_length = true;
-			std::cout << "Found file with bad length" << std::endl;
-		}
-		f.length = len;
-		f.type = type;
-		files.push_back(f);
+// Prints the entries of a directory, one per line after prefix.
+static void print_entries(const LbrIndex & index, bool skip_deleted, bool sort_numerical, const std::string & prefix) {
+	std::vector<FileEntry> sorted;
+	if (sort_numerical) {
+		sorted = index.files;
+		sort_numerically(sorted);
 	}
-	for (const auto & f : files) {
-		if (f.bad_length) {
-			// Just glob up everything
-			std::filesystem::path fp = dest_folder;
-			fp /= f.name;
-			std::ofstream out(fp, std::ofstream::binary);
-			auto pos = in.tellg();
-			in.seekg(0, in.end);
-			int length = in.tellg() - pos;
-			in.seekg(pos, in.beg);
-			char* buffer = new char[length];
-			in.read(buffer, length);
-			out.write(buffer, length);
-			out.close();
-			delete[] buffer;
-			break;
-		}
-		if (f.length == 0) continue;
+	for (const auto & f : sort_numerical ? sorted : index.files) {
 		if (f.type == "D" && skip_deleted) {
-			in.ignore(f.length);
+			if (options.verbose)
+				std::cout << prefix << "[deleted]" << std::endl;
 			continue;
+		} else
+			std::cout << prefix << f.ascii_name << " (" << petscii2ascii(f.type) << ") " << f.length;
+		if (f.bad_length) {
+			if (options.verbose)
+				std::cout << " (bad)";
 		}
-		if (!targets.empty()) {
-			bool found = false;
-			for (const auto & t : targets) {
-				if (petscii2ascii(f.name) == t) {
-					found = true;
-					break;
-				}
-			}
-			if(!found) in.ignore(f.length);
-		}
-		std::filesystem::path fp = dest_folder;
-		std::string ascii_name = petscii2ascii(f.name);
-		if (add_extension) {
-			if (f.type == "P")
-				ascii_name += ".prg";
-			else if (f.type == "S")
-				ascii_name += ".seq";
-			else if (f.type == "U")
-				ascii_name += ".usr";
-			else if (f.type == "R")
-				ascii_name += ".rel";
-		}
-		fp /= ascii_name;
-		std::ofstream out(fp, std::ofstream::binary);
-		char* buffer = new char[f.length];
-		in.read(buffer, f.length);
-		out.write(buffer, f.length);
-		out.close();
-		delete[] buffer;
+		std::cout << std::endl;
 	}
-
-	in.close();
-	return 0;
 }
 
-int find_in_lbr(std::string infile, std::string target, int & length, long & offset, long & diroffset, bool skip_deleted) {
-	std::ifstream in(infile, std::ifstream::binary);
-	char signature[3];
-	in.read(signature, 3);
-	if (signature[0] != 'D' || signature[1] != 'W' || signature[2] != 'B') {
-		in.close();
+// Lists the entries of the archive file, "-" for standard input.
+// Reads only the directory, never the payloads.
+static int list_lbr(std::string file, bool skip_deleted, bool sort_numerical) {
+	LbrIndex index;
+	int res = file == "-" ? read_stream_directory(STDIN_FILENO, index) : read_directory(file, index);
+	if (res != LBR_OK) {
 		std::cout << "Error: invalid signature, not an LBR file?" << std::endl;
-		return -1;
-	}
-	in.ignore(1); // space
-	char count[256];
-	in.get(count, 256, 0x20);
-	in.ignore(1); // space
-	in.ignore(1); // cr
-	int file_count = atoi(count);
-	long coff = 0;
-	bool found = false;
-	for (int i = 0; i < file_count; ++i) {
-		// TODO: error handling
-		long doff = in.tellg();
-		char name[256];
-		in.get(name, 256, 0x0D);
-		in.ignore(1);
-		char type[256];
-		in.get(type, 256, 0x0D);
-		in.ignore(1); // cr
-		in.ignore(1); // space
-		char len[256];
-		in.get(len, 256, 0x20);
-		in.ignore(1); // space
-		in.ignore(1); // cr
-		int l = atoi(len);
-		if (!found && petscii2ascii(name) == target) {
-			if (type[0] != 'D' || !skip_deleted) {
-				length = l;
-				diroffset = doff;
-				found = true;
-			}
-		}
-		if (!found)
-			coff += l;
-		if (l < 0 || l > MAX_SANE_LENGTH) {
-			std::cout << "Found file with bad length" << std::endl;
-			return -1;
-		}
-	}
-	if (found) {
-		offset = in.tellg() + coff;
-		return 0;
-	}
-	return -1;
-}
-
-int delete_lbr(std::string file, std::string target, bool skip_deleted, bool wipe) {
-	int length = 0;
-	long offset = 0;
-	long dir_offset = 0;
-	int res = find_in_lbr(file, target, length, offset, dir_offset, skip_deleted);
-	if (res != 0) {
-		std::cout << "No deletion occured." << std::endl;
 		return res;
 	}
-	std::FILE* tmpf = std::tmpfile();
-	std::ifstream in(file, std::ifstream::binary);
-
-	char signature[4];
-	in.read(signature, 3);
-	signature[3] = 0x00;
-	std::fputs(signature, tmpf);
-	if (wipe) {
-		std::fputc(in.get(), tmpf); // space
-		char count[256];
-		in.get(count, 256, 0x20);
-		int file_count = atoi(count);
-		std::fputs(std::to_string(file_count-1).c_str(), tmpf);
-		std::fputc(in.get(), tmpf); // space
-		std::fputc(in.get(), tmpf); // cr
-	}
-
-	char c;
-	while (in.get(c) && in.tellg() < dir_offset)
-		std::fputc(c, tmpf);
-	std::fputc(c, tmpf);
-	if (wipe) {
-		while (in.get(c) && c != 0x0D) {} // name
-		while (in.get(c) && c != 0x0D) {} // type
-		while (in.get(c) && c != 0x0D) {} // size
-	} else {
-		// Update directory entry.
-		while (in.get(c) && c != 0x0D)
-			std::fputc(c, tmpf);
-		std::fputc(0x0D, tmpf);
-		std::fputc('D', tmpf);
-		std::fputc(0x0D, tmpf);
-		std::fputs(" 0 ", tmpf);
-		std::fputc(0x0D, tmpf);
-		while (in.get(c) && c != 0x0D) {} // type
-		while (in.get(c) && c != 0x0D) {} // size
-	}
-
-	while (in.get(c) && in.tellg() <= offset)
-		std::fputc(c, tmpf);
-	in.seekg(offset + length, in.beg); // skip over the file
-	while (in.get(c))
-		std::fputc(c, tmpf);
-	if (!in.eof()) {
-		std::cout << "Error reading from archive." << std::endl;
-	}
-	in.close();
-	std::ofstream out(file, std::ofstream::binary);
-	std::rewind(tmpf);
-	int ch;
-	while ((ch = std::fgetc(tmpf)) != EOF) {
-		out.put(ch);
-	}
-	out.close();
-	std::fclose(tmpf);
-	return 0;
+	std::string basename = std::filesystem::path(file).filename();
+	if (options.verbose)
+		std::cout << basename << " " << index.count << " entries" << std::endl;
+	print_entries(index, skip_deleted, sort_numerical, "");
+	return LBR_OK;
 }
 
-int chtype_lbr(std::string file, std::string target, std::string new_type, bool skip_deleted) {
-	int length = 0;
-	long offset = 0;
-	long dir_offset = 0;
-	int res = find_in_lbr(file, target, length, offset, dir_offset, skip_deleted);
-	if (res != 0) {
-		std::cout << "Failed" << std::endl;
-		return res;
-	}
-	std::FILE* tmpf = std::tmpfile();
-	std::ifstream in(file, std::ifstream::binary);
-
-	char signature[4];
-	in.read(signature, 3);
-	signature[3] = 0x00;
-	std::fputs(signature, tmpf);
-
-	char c;
-	while (in.get(c) && in.tellg() < dir_offset)
-		std::fputc(c, tmpf);
-	std::fputc(c, tmpf);
-	while (in.get(c) && c != 0x0D)
-		std::fputc(c, tmpf); // name
-	std::fputc(0x0D, tmpf);
-	std::fputs(ascii2petscii(new_type).c_str(), tmpf);
-	std::fputc(0x0D, tmpf);
-	while (in.get(c) && c != 0x0D) {} // type
-	while (in.get(c))
-		std::fputc(c, tmpf);
-	if (!in.eof()) {
-		std::cout << "Error reading from archive." << std::endl;
-	}
-	in.close();
-	std::ofstream out(file, std::ofstream::binary);
-	std::rewind(tmpf);
-	int ch;
-	while ((ch = std::fgetc(tmpf)) != EOF) {
-		out.put(ch);
-	}
-	out.close();
-	std::fclose(tmpf);
-	return 0;
+// Lists every archive under roots, reading only their directories, with
+// each line prefixed by the archive path.
+static int list_many(const std::vector<std::string> & roots, bool skip_deleted, bool sort_numerical) {
+	std::vector<std::string> paths = find_archives(roots);
+	scan_directories(paths, [&](size_t i, int res, const LbrIndex & index) {
+		if (res != LBR_OK) {
+			std::cout << paths[i] << ": Error: invalid signature, not an LBR file?" << std::endl;
+			return;
+		}
+		if (options.verbose)
+			std::cout << paths[i] << ": " << index.count << " entries" << std::endl;
+		print_entries(index, skip_deleted, sort_numerical, paths[i] + ": ");
+	});
+	return LBR_OK;
 }
 
-int add_lbr(std::string file, std::vector<std::string> targets, bool strip_extension) {
-	long offset = 0;
-	std::FILE* tmpf = std::tmpfile();
-	std::ifstream in(file, std::ifstream::binary);
-	char signature[4];
-	in.read(signature, 3);
-	if (signature[0] != 'D' || signature[1] != 'W' || signature[2] != 'B') {
-		in.close();
-		std::cout << "Error: invalid signature, not an LBR file?" << std::endl;
-		return -1;
-	}
-	signature[3] = 0x00;
-	std::fputs(signature, tmpf);
-	std::fputc(in.get(), tmpf); // space
-	char count[256];
-	in.get(count, 256, 0x20);
-	int file_count = atoi(count);
-	std::fputs(std::to_string(file_count+targets.size()).c_str(), tmpf);
-	std::fputc(in.get(), tmpf); // space
-	std::fputc(in.get(), tmpf); // cr
-	std::vector<FileEntry> files;
-	for (const auto & a : targets) {
-		FileEntry f;
-		f.name = std::filesystem::path(a).filename();
-		f.path = a;
-		f.length = std::filesystem::file_size(a);
-		files.push_back(f);
-	}
-
-	for (int i = 0; i < file_count; ++i) {
-		// TODO: error handling
-		char c;
-		while (in.get(c) && c != 0x0D)
-			std::fputc(c, tmpf); // name
-		std::fputc(0x0D, tmpf);
-		while (in.get(c) && c != 0x0D)
-			std::fputc(c, tmpf); // type
-		std::fputc(0x0D, tmpf);
-		std::fputc(in.get(), tmpf); // space
-		char len[256];
-		in.get(len, 256, 0x20);
-		std::fputs(len, tmpf);
-		std::fputc(in.get(), tmpf); // space
-		std::fputc(in.get(), tmpf); // cr
-		int l = atoi(len);
-		offset += l;
-		if (l < 0 || l > MAX_SANE_LENGTH) {
-			std::cout << "Found file with bad length" << std::endl;
-			return -1;
+// Prints the entries called name in every archive under roots.
+static int find_many(const std::string & name, const std::vector<std::string> & roots, bool skip_deleted) {
+	std::vector<std::string> paths = find_archives(roots);
+	scan_directories(paths, [&](size_t i, int res, const LbrIndex & index) {
+		if (res != LBR_OK) {
+			if (options.verbose)
+				std::cout << paths[i] << ": Error: invalid signature, not an LBR file?" << std::endl;
+			return;
 		}
-	}
-	offset += in.tellg();
-	for (const auto & f : files) {
-		if (verbose)
-			std::cout << "+ " << f.name;
-		std::string ext = std::filesystem::path(f.name).extension();
-		std::transform(ext.begin(), ext.end(), ext.begin(),
-			[](auto c){ return std::tolower(c); });
-		if (strip_extension) {
-			size_t dot = f.name.find_last_of(".");
-			if (dot == std::string::npos)
-				std::fputs(ascii2petscii(f.name).c_str(), tmpf);
-			else
-				std::fputs(ascii2petscii(f.name.substr(0, dot)).c_str(), tmpf);
-		} else
-			std::fputs(ascii2petscii(f.name).c_str(), tmpf);
-		std::fputc(0x0D, tmpf);
-		if (f.length == 0)
-			std::fputc('D', tmpf);
-		else {
-			if (ext == ".prg")
-				std::fputc('P', tmpf);
-			else if (ext == ".usr")
-				std::fputc('U', tmpf);
-			else if (ext == ".rel")
-				std::fputc('R', tmpf);
-			else
-				std::fputc('S', tmpf);
+		for (const auto & f : index.files) {
+			if (f.ascii_name != name || (f.type == "D" && skip_deleted))
+				continue;
+			std::cout << paths[i] << ": " << f.ascii_name << " (" << petscii2ascii(f.type) << ") " << f.length << std::endl;
 		}
-		std::fputc(0x0D, tmpf);
-		std::fputc(0x20, tmpf);
-		std::fputs(std::to_string(f.length).c_str(), tmpf);
-		std::fputc(0x20, tmpf);
-		std::fputc(0x0D, tmpf);
-	}
-
-	char c;
-	while (in.get(c) && in.tellg() <= offset)
-		std::fputc(c, tmpf);
+	});
+	return LBR_OK;
+}
 
-	for (const auto & f : files) {
-		if (f.length > 0) {
-			std::ifstream infile(f.path, std::ifstream::binary);
-			char* buffer = new char[f.length];
-			infile.read(buffer, f.length);
-			std::fwrite(buffer, sizeof buffer[0], f.length, tmpf);
-			delete[] buffer;
+// Verifies every archive under roots, printing each problem and, with a
+// checksum, the sum of every entry. Returns the number of archives with
+// problems.
+static int verify_many(const std::vector<std::string> & roots, LbrChecksum sum) {
+	std::vector<std::string> paths = find_archives(roots);
+	int bad = 0;
+	for (const auto & path : paths) {
+		LbrVerifyResult result;
+		verify_lbr(path, sum, result);
+		for (const auto & p : result.problems)
+			std::cout << path << ": " << p << std::endl;
+		for (size_t i = 0; i < result.checksums.size(); ++i) {
+			const FileEntry & f = result.index.files[i];
+			char hex[17];
+			snprintf(hex, sizeof(hex), sum == LbrChecksum::Crc32c ? "%08llx" : "%016llx",
+				(unsigned long long)result.checksums[i]);
+			std::cout << path << ": " << f.ascii_name << " (" << petscii2ascii(f.type) << ") "
+				<< f.length << " " << hex << std::endl;
+		}
+		if (result.problems.empty())
+			std::cout << path << ": OK, " << result.index.files.size() << " entries" << std::endl;
+		else {
+			size_t n = result.problems.size();
+			std::cout << path << ": " << n << (n == 1 ? " problem" : " problems") << std::endl;
+			++bad;
 		}
 	}
-
-	while (in.get(c))
-		std::fputc(c, tmpf);
-	if (!in.eof()) {
-		std::cout << "Error reading from archive." << std::endl;
-	}
-	in.close();
-	std::ofstream out(file, std::ofstream::binary);
-	std::rewind(tmpf);
-	int ch;
-	while ((ch = std::fgetc(tmpf)) != EOF) {
-		out.put(ch);
-	}
-	out.close();
-	std::fclose(tmpf);
-	return 0;
+	return bad;
 }
 
-int list_lbr(std::string file, bool skip_deleted, bool sort_numerical) {
-	std::ifstream in(file, std::ifstream::binary);
-	char signature[4];
-	in.read(signature, 3);
-	if (signature[0] != 'D' || signature[1] != 'W' || signature[2] != 'B') {
-		in.close();
-		std::cout << "Error: invalid signature, not an LBR file?" << std::endl;
-		return -1;
-	}
-	in.ignore(1); // space
-	char count[256];
-	in.get(count, 256, 0x20);
-	in.ignore(1); // space
-	in.ignore(1); // cr
-	int file_count = atoi(count);
-	std::string basename = std::filesystem::path(file).filename();
-	if (verbose)
-		std::cout << basename << " " << file_count << " entries" << std::endl;
-
-	std::vector<FileEntry> files;
-	for (int i = 0; i < file_count; ++i) {
-		// TODO: error handling
-		char name[256];
-		in.get(name, 256, 0x0D);
-		in.ignore(1);
-		char type[256];
-		in.get(type, 256, 0x0D);
-		in.ignore(1); // cr
-		in.ignore(1); // space
-		char length[256];
-		in.get(length, 256, 0x20);
-		in.ignore(1); // space
-		in.ignore(1); // cr
-		FileEntry f;
-		f.name = name;
-		f.length = atoi(length);
-		f.type = type;
-		files.push_back(f);
-	}
-	if (sort_numerical)
-		std::sort(files.begin(), files.end(), num_cmp);
-	for (const auto & f : files) {
-		if (f.type == "D" && skip_deleted) {
-			if (verbose)
-				std::cout << "[deleted]" << std::endl;
-			continue;
-		} else
-			std::cout << petscii2ascii(f.name) << " (" << petscii2ascii(f.type) << ") " << f.length;
-		if (f.length < 0 || f.length > MAX_SANE_LENGTH) {
-			if (verbose)
-				std::cout << " (bad)";
-		}
-		std::cout << std::endl;
-	}
-	in.close();
-	return 0;
+// Opens the archive and applies steps to it, parsing it only the once.
+static int edit_lbr(std::string file, const std::vector<BatchStep> & steps, bool skip_deleted, bool strip_extension) {
+	LbrArchive archive(options);
+	int res = archive.open(file);
+	if (res != LBR_OK) return res;
+	return archive.apply(steps, skip_deleted, strip_extension, false);
 }
 
 enum class Op {
@@ -644,7 +212,13 @@ enum class Op {
 	Append,
 	Delete,
 	Wipe,
-	ChangeType
+	ChangeType,
+	Batch,
+	Find,
+	Compact,
+	Cat,
+	Verify,
+	Sync
 };
 
 static void print_help()
@@ -652,35 +226,60 @@ static void print_help()
 	printf("\
 Usage: lbr ACTION [OPTIONS] ARCHIVE [FILES...]\n");
 	fputs("\
-Create, extract and modify C64 LBR archives.\n", stdout);
+Create, extract and modify C64 LBR archives.\n\
+ARCHIVE may be - to list or extract from standard input.\n", stdout);
 	puts("");
 	fputs("\
   -h, --help          display this help and exit\n\
   -V, --version       display version information and exit\n\
-  -v, --verbose       increase verbosity of printing\n", stdout);
+  -v, --verbose       increase verbosity of printing\n\
+  -j, --jobs=N        use up to N threads where an action can\n", stdout);
 	puts("");
 	fputs("\
  Actions:\n\
   -a, --append               add files to the end of the archive\n\
   -l, --list                 print out entries in the archive (default action)\n\
+  -f, --find=FILENAME        print FILENAME in every archive given or under the given folders\n\
   -c, --create               create an archive with the given files\n\
   -e, --extract              extract from the archive\n\
   -E, --extract-into=FOLDER  extract from the archive, into the given FOLDER\n\
+  -O, --to-stdout=FILENAME   extract FILENAME to standard output, may be repeated\n\
+  -k, --cat=FILENAME         write FILENAME to standard output, reading only it and the\n\
+                             directory\n\
   -t, --type=FILENAME:TYPE   change filetype of a file in the archive to TYPE\n\
   -d, --delete=FILENAME      delete a file from the archive, keeping the entry\n\
-  -w, --wipe=FILENAME        delete a file from the archive completely\n", stdout);
+  -w, --wipe=FILENAME        delete a file from the archive completely\n\
+  -B, --batch=SCRIPT         apply the edits listed in SCRIPT in one rewrite\n\
+  -C, --compact[=padding]    drop every deleted entry from the archive; with padding,\n\
+                             keep the numbered slots of --pad-sorted\n\
+  -u, --sync[=contents]      make the archive match the files in the folder given after it,\n\
+                             rewriting it once and only if anything differs; with\n\
+                             contents, compare entries of equal length byte by byte\n\
+  -y, --verify[=SUM]         check every archive given or under the given folders against\n\
+                             its directory; SUM may be crc32c or xxh64 to print a\n\
+                             checksum of each entry\n\
+Several of -a, -d, -w, -t and -C may be given together. They are applied in order,\n\
+but the files of -a are always appended last.\n", stdout);
 	puts("");
 	fputs("\
  Options for actions:\n\
   -n, --sort            when creating archive and printing entries, sort files numerically\n\
+  -r, --recursive       list every archive given or under the given folders\n\
   -b, --skip-deleted    skip over files marked as deleted (filetype D)\n\
   -s, --strip           remove extensions when adding files to archive\n\
+  -D, --dedup           when adding files, name those with the same contents as another\n\
+  -K, --dedup-skip      when adding files, leave out those with the same contents as\n\
+                        another file or entry\n\
   -X, --add-extension   adds an extension to extracted files\n\
   -p, --pad-sorted      when creating sorted archive, add deleted files as padding (Advanced)\n\
-  -P, --no-conversion   do not convert between ASCII and PETSCII (Advanced)\n", stdout);
-	puts("");
-	fputs("\
-Please backup files before using the program.\n", stdout);
+  -P, --no-conversion   do not convert between ASCII and PETSCII (Advanced)\n\
+  -M, --max-length=N    treat entries longer than N bytes as corrupt, 0 for no limit\n\
+                        (default 16 MiB) (Advanced)\n\
+  -I, --in-place        change the archive in place instead of replacing it; faster\n\
+                        for big archives, but a crash halfway leaves it broken (Advanced)\n\
+  -i, --index-cache     when listing and finding, keep each parsed directory in\n\
+                        ARCHIVE.idx and reuse it while the archive is unchanged\n\
+  -S, --stats[=json]    print time and I/O per phase when done, as a table or JSON\n", stdout);
 	printf ("\n");
 }
 // TODO: strip should be default on
@@ -700,8 +299,18 @@ int main(int argc, char *argv[])
 	Op operation = Op::List;
 	int opcount = 0;
 	std::string new_type;
-
-	while ((optc = getopt_long(argc, argv, "ad:lceE:w:t:npsbXPhvV", long_options, NULL)) != -1)
+	int mutations = 0;
+	bool append = false;
+	std::vector<BatchStep> steps;
+	std::string batch_script;
+	std::vector<std::string> to_stdout;
+	LbrStats stats;
+	bool stats_json = false;
+	bool recursive = false;
+	LbrChecksum checksum = LbrChecksum::None;
+	bool sync_contents = false;
+
+	while ((optc = getopt_long(argc, argv, "ad:lrf:ceE:O:k:w:t:B:C::y::u::j:M:IinpsDKbXPhvVS::", long_options, NULL)) != -1)
 		switch (optc) {
 			case 'h':
 				print_help();
@@ -710,31 +319,54 @@ int main(int argc, char *argv[])
 				print_version();
 				exit(0);
 			case 'v':
-				verbose = true;
+				options.verbose = true;
+				break;
+			case 'j':
+				if (!optarg) abort();
+				options.jobs = atoi(optarg);
+				if (options.jobs < 1) {
+					std::cout << "Invalid number of jobs: " << optarg << std::endl;
+					exit(1);
+				}
 				break;
 			case 'a':
 				opcount += 1;
+				mutations += 1;
 				operation = Op::Append;
+				append = true;
 				break;
 			case 'l':
 				opcount += 1;
 				operation = Op::List;
 				break;
+			case 'r':
+				recursive = true;
+				break;
+			case 'f':
+				opcount += 1;
+				operation = Op::Find;
+				if (!optarg) abort();
+				target_file = optarg;
+				break;
 			case 'c':
 				opcount += 1;
 				operation = Op::Create;
 				break;
 			case 'd':
 				opcount += 1;
+				mutations += 1;
 				operation = Op::Delete;
 				if (!optarg) abort();
 				target_file = optarg;
+				steps.push_back({BatchOp::Delete, target_file, ""});
 				break;
 			case 'w':
 				opcount += 1;
+				mutations += 1;
 				operation = Op::Wipe;
 				if (!optarg) abort();
 				target_file = optarg;
+				steps.push_back({BatchOp::Wipe, target_file, ""});
 				break;
 			case 't':
 			{
@@ -750,8 +382,48 @@ int main(int argc, char *argv[])
 				}
 				target_file = str.substr(0, cln);
 				new_type = str.substr(cln+1);
+				mutations += 1;
+				steps.push_back({BatchOp::ChangeType, target_file, new_type});
 				break;
 			}
+			case 'C':
+				if (optarg && std::string(optarg) != "padding") {
+					std::cout << "Unknown argument: " << optarg << std::endl;
+					print_help();
+					exit(1);
+				}
+				opcount += 1;
+				mutations += 1;
+				operation = Op::Compact;
+				steps.push_back({BatchOp::Compact, "", optarg ? "padding" : ""});
+				break;
+			case 'u':
+				if (optarg && std::string(optarg) != "contents") {
+					std::cout << "Unknown argument: " << optarg << std::endl;
+					print_help();
+					exit(1);
+				}
+				sync_contents = optarg != NULL;
+				opcount += 1;
+				operation = Op::Sync;
+				break;
+			case 'y':
+				if (optarg && std::string(optarg) == "crc32c")
+					checksum = LbrChecksum::Crc32c;
+				else if (optarg && std::string(optarg) == "xxh64")
+					checksum = LbrChecksum::Xxh64;
+				else if (optarg) {
+					std::cout << "Unknown checksum: " << optarg << std::endl;
+					print_help();
+					exit(1);
+				}
+				opcount += 1;
+				operation = Op::Verify;
+				break;
+			case 'B':
+				if (!optarg) abort();
+				batch_script = optarg;
+				break;
 			case 'e':
 				opcount += 1;
 				operation = Op::Extract;
@@ -762,6 +434,16 @@ int main(int argc, char *argv[])
 				if (!optarg) abort();
 				path = optarg;
 				break;
+			case 'O':
+				if (!optarg) abort();
+				to_stdout.push_back(optarg);
+				break;
+			case 'k':
+				opcount += 1;
+				operation = Op::Cat;
+				if (!optarg) abort();
+				target_file = optarg;
+				break;
 			case 'n':
 				sort_numerical = true;
 				break;
@@ -778,13 +460,58 @@ int main(int argc, char *argv[])
 				add_extension = true;
 				break;
 			case 'P':
-				convert_petscii = false;
+				options.convert_petscii = false;
+				break;
+			case 'I':
+				options.in_place = true;
+				break;
+			case 'i':
+				options.index_cache = true;
+				break;
+			case 'D':
+				if (options.dedup == LbrDedup::Off)
+					options.dedup = LbrDedup::Report;
+				break;
+			case 'K':
+				options.dedup = LbrDedup::Skip;
+				break;
+			case 'S':
+				if (optarg && std::string(optarg) != "json") {
+					std::cout << "Unknown stats format: " << optarg << std::endl;
+					exit(1);
+				}
+				stats_json = optarg != NULL;
+				options.stats = &stats;
+				break;
+			case 'M':
+				if (!optarg) abort();
+				if (!parse_number(optarg, options.max_length)) {
+					std::cout << "Invalid length: " << optarg << std::endl;
+					exit(1);
+				}
 				break;
 			default:
 				print_help();
 				exit(1);
 		}
 
+	if (mutations > 1 || !batch_script.empty()) {
+		// Any number of edits run together as one batch.
+		opcount = opcount - mutations + 1;
+		operation = Op::Batch;
+	}
+
+	if (!to_stdout.empty()) {
+		if (opcount == 0) {
+			opcount = 1;
+			operation = Op::Extract;
+		} else if (operation != Op::Extract) {
+			std::cout << "--to-stdout can only be used when extracting." << std::endl;
+			print_help();
+			exit(1);
+		}
+	}
+
 	if (opcount > 1) {
 		std::cout << "Only 1 action may be specified at a time." << std::endl;
 		print_help();
@@ -802,14 +529,20 @@ int main(int argc, char *argv[])
 		files.push_back(argv[optind++]);
 	}
 
-	if (operation != Op::Create) {
+	if (recursive && operation != Op::List) {
+		std::cout << "--recursive can only be used when listing." << std::endl;
+		print_help();
+		exit(1);
+	}
+
+	if (operation != Op::Create && lbrfile != "-") {
 		if (!std::filesystem::exists(lbrfile)) {
 			std::cout << "File not found: " << lbrfile << std::endl;
 			exit(1);
 		}
 	}
 
-	if (operation != Op::Delete && operation != Op::Wipe) {
+	if (operation != Op::Delete && operation != Op::Wipe && operation != Op::Extract) {
 		for (const auto & a : files) {
 			if (!std::filesystem::exists(a)) {
 				std::cout << "File not found: " << a << std::endl;
@@ -817,7 +550,9 @@ int main(int argc, char *argv[])
 			}
 		}
 	}
-	if (operation == Op::List || operation == Op::ChangeType) {
+	if ((operation == Op::List && !recursive) || operation == Op::ChangeType || operation == Op::Compact
+		|| operation == Op::Cat
+		|| (operation == Op::Batch && !append)) {
 		if (!files.empty()) {
 			std::cout << "Got extra unhandled arguments." << std::endl;
 			print_help();
@@ -825,25 +560,81 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// Messages go where they do not mix with payloads.
+	options.log = to_stdout.empty() && operation != Op::Cat ? &std::cout : &std::cerr;
+	LbrOptionsScope scope(options);
+	auto start = std::chrono::steady_clock::now();
 	if (operation == Op::Create)
 		build_lbr(lbrfile, files, sort_numerical, sort_numerical_padding, strip_extensions);
 	else if (operation == Op::Extract)
-		extract_lbr(lbrfile, path, files, skip_deleted, add_extension);
+	{
+		if (!to_stdout.empty() || lbrfile == "-") {
+			files.insert(files.end(), to_stdout.begin(), to_stdout.end());
+			extract_lbr(lbrfile, path, files, skip_deleted, add_extension, !to_stdout.empty());
+		} else {
+			LbrArchive archive(options);
+			if (archive.open(lbrfile) == LBR_OK)
+				archive.extract(path, files, skip_deleted, add_extension);
+		}
+	}
 	else if (operation == Op::Delete)
-		delete_lbr(lbrfile, target_file, skip_deleted, false);
+		edit_lbr(lbrfile, {{BatchOp::Delete, target_file, ""}}, skip_deleted, false);
 	else if (operation == Op::Wipe)
-		delete_lbr(lbrfile, target_file, skip_deleted, true);
-	else if (operation == Op::Append)
-		add_lbr(lbrfile, files, strip_extensions);
+		edit_lbr(lbrfile, {{BatchOp::Wipe, target_file, ""}}, skip_deleted, false);
+	else if (operation == Op::Append) {
+		for (const auto & a : files)
+			steps.push_back({BatchOp::Append, a, ""});
+		edit_lbr(lbrfile, steps, false, strip_extensions);
+	}
+	else if (operation == Op::List && recursive) {
+		files.insert(files.begin(), lbrfile);
+		list_many(files, skip_deleted, sort_numerical);
+	}
 	else if (operation == Op::List)
 		list_lbr(lbrfile, skip_deleted, sort_numerical);
+	else if (operation == Op::Find) {
+		files.insert(files.begin(), lbrfile);
+		find_many(target_file, files, skip_deleted);
+	}
+	else if (operation == Op::Compact)
+		edit_lbr(lbrfile, steps, false, false);
+	else if (operation == Op::Sync) {
+		if (files.size() != 1) {
+			std::cout << "--sync takes the archive and one folder." << std::endl;
+			print_help();
+			exit(1);
+		}
+		sync_lbr(lbrfile, files[0], sync_contents, strip_extensions);
+	}
+	else if (operation == Op::Verify) {
+		files.insert(files.begin(), lbrfile);
+		if (verify_many(files, checksum) > 0)
+			exit(1);
+	}
+	else if (operation == Op::Cat) {
+		if (lbrfile == "-") // a pipe has to be read up to the entry anyway
+			extract_lbr(lbrfile, path, {target_file}, skip_deleted, false, true);
+		else
+			cat_lbr(lbrfile, target_file, skip_deleted);
+	}
 	else if (operation == Op::ChangeType)
-		chtype_lbr(lbrfile, target_file, new_type, skip_deleted);
+		edit_lbr(lbrfile, {{BatchOp::ChangeType, target_file, new_type}}, skip_deleted, false);
+	else if (operation == Op::Batch) {
+		if (!batch_script.empty() && read_batch_script(batch_script, steps) != LBR_OK)
+			exit(1);
+		for (const auto & a : files)
+			steps.push_back({BatchOp::Append, a, ""});
+		edit_lbr(lbrfile, steps, skip_deleted, strip_extensions);
+	}
 	else {
 		std::cout << "No action specified." << std::endl;
 		print_help();
 		exit(1);
 	}
+	if (options.stats) {
+		std::chrono::duration<double, std::milli> total = std::chrono::steady_clock::now() - start;
+		print_stats(*options.log, stats, total.count(), stats_json);
+	}
 }
 
 static void print_version()
@@ -0,0 +1,2999 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+#include <iostream>
+#include <filesystem> // c++17
+#include <fstream>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <array>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string_view>
+#include <cerrno>
+#include <cstdint>
+#include <charconv>
+#include <cstring>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include "petscii.h"
+#include "liblbr.h"
+#ifdef LBR_IO_URING
+#include "uring.h"
+#endif
+
+const size_t COPY_BLOCK_SIZE = 1024*1024;
+// First read of a directory, enough for a few thousand entries.
+const size_t DIRECTORY_PREFETCH = 64*1024;
+#ifdef LBR_IO_URING
+// Requests in flight at once, and how much a batch of small payloads
+// being built into an archive may hold.
+const unsigned URING_DEPTH = 256;
+const size_t URING_BATCH_BYTES = 8*1024*1024;
+#endif
+
+static const LbrOptions default_options;
+static thread_local const LbrOptions * current_options = &default_options;
+
+LbrOptionsScope::LbrOptionsScope(const LbrOptions & opts) : saved(current_options) {
+	current_options = &opts;
+}
+
+LbrOptionsScope::~LbrOptionsScope() {
+	current_options = saved;
+}
+
+const LbrOptions & lbr_options() {
+	return *current_options;
+}
+
+// Where messages go; nowhere unless the options say so.
+static std::ostream & lbr_log() {
+	static thread_local std::ostream discard(nullptr);
+	return lbr_options().log ? *lbr_options().log : discard;
+}
+
+const char * lbr_phase_name(int phase) {
+	switch (phase) {
+		case LBR_PHASE_PARSE: return "parse";
+		case LBR_PHASE_CONVERT: return "convert";
+		case LBR_PHASE_COPY: return "copy";
+		case LBR_PHASE_REWRITE: return "rewrite";
+		case LBR_PHASE_SYNC: return "sync";
+		case LBR_PHASE_HASH: return "hash";
+		case LBR_PHASE_OTHER: return "other";
+	}
+	return "unknown";
+}
+
+static thread_local int current_phase = LBR_PHASE_OTHER;
+
+static void count_read(ssize_t n) {
+	LbrStats * stats = lbr_options().stats;
+	if (!stats || n < 0) return;
+	stats->phase[current_phase].reads++;
+	stats->phase[current_phase].bytes_read += n;
+}
+
+static void count_write(ssize_t n) {
+	LbrStats * stats = lbr_options().stats;
+	if (!stats || n < 0) return;
+	stats->phase[current_phase].writes++;
+	stats->phase[current_phase].bytes_written += n;
+}
+
+// Charges the time until it is destroyed, and the I/O in between, to a
+// phase. Timers nested in it pause it. Does nothing without stats.
+class PhaseTimer {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	explicit PhaseTimer(int phase) : stats(lbr_options().stats), phase(phase) {
+		if (!stats) return;
+		Clock::time_point now = Clock::now();
+		parent = current_timer;
+		if (parent) parent->charge(now);
+		saved_phase = current_phase;
+		current_phase = phase;
+		current_timer = this;
+		start = now;
+	}
+	~PhaseTimer() {
+		if (!stats) return;
+		Clock::time_point now = Clock::now();
+		charge(now);
+		current_timer = parent;
+		current_phase = saved_phase;
+		if (parent) parent->start = now;
+	}
+	PhaseTimer(const PhaseTimer &) = delete;
+	PhaseTimer & operator=(const PhaseTimer &) = delete;
+
+private:
+	void charge(Clock::time_point now) {
+		stats->phase[phase].nanoseconds +=
+			std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+		start = now;
+	}
+
+	static thread_local PhaseTimer * current_timer;
+	LbrStats * stats;
+	int phase;
+	int saved_phase = LBR_PHASE_OTHER;
+	PhaseTimer * parent = nullptr;
+	Clock::time_point start;
+};
+
+thread_local PhaseTimer * PhaseTimer::current_timer = nullptr;
+
+const char * lbr_status_string(int status) {
+	switch (status) {
+		case LBR_OK: return "Success";
+		case LBR_NOT_LBR: return "Invalid signature, not an LBR file";
+		case LBR_NOT_FOUND: return "Not found";
+		case LBR_BAD_LENGTH: return "Found file with bad length";
+		case LBR_READ_ERROR: return "Error reading";
+		case LBR_WRITE_ERROR: return "Error writing";
+		case LBR_INVALID: return "Invalid argument";
+		case LBR_CORRUPT: return "Archive does not match its directory";
+	}
+	return "Unknown error";
+}
+
+
+std::string petscii2ascii(std::string_view petscii) {
+	PhaseTimer timer(LBR_PHASE_CONVERT);
+	std::string ascii(petscii);
+	if (lbr_options().convert_petscii)
+		petscii2ascii(ascii.data(), ascii.size(), ascii.data());
+	return ascii;
+}
+
+std::string ascii2petscii(std::string_view ascii) {
+	PhaseTimer timer(LBR_PHASE_CONVERT);
+	std::string petscii(ascii);
+	if (lbr_options().convert_petscii)
+		ascii2petscii(petscii.data(), petscii.size(), petscii.data());
+	return petscii;
+}
+
+bool num_cmp(const FileEntry & i,const FileEntry & j) {
+	if (i.name.length() < j.name.length())
+		return true;
+	if (i.name.length() > j.name.length())
+		return false;
+	return i.name.compare(j.name) < 0;
+}
+
+// Directories from this size on are sorted by key with a radix sort.
+const size_t RADIX_SORT_MIN = 1024;
+
+// Sorts files as num_cmp orders them. Every name is turned into a 64 bit
+// key once: its length in the top byte, then the seven bytes after the
+// prefix all names share. Keys are sorted as integers, with a radix sort
+// for big directories, and only names their keys do not tell apart are
+// then compared in full.
+void sort_numerically(std::vector<FileEntry> & files) {
+	size_t n = files.size();
+	if (n < 2) return;
+	size_t common = files[0].name.size();
+	for (const auto & f : files) {
+		common = std::min(common, f.name.size());
+		common = std::mismatch(f.name.begin(), f.name.begin() + common, files[0].name.begin()).first - f.name.begin();
+	}
+	struct Key {
+		uint64_t key;
+		size_t index;
+	};
+	std::vector<Key> keys(n);
+	for (size_t i = 0; i < n; ++i) {
+		const std::string & name = files[i].name;
+		// All names of 255 bytes and more get the same key.
+		uint64_t k = std::min<uint64_t>(name.size(), 255) << 56;
+		for (size_t b = 0; b < 7 && common + b < name.size() && name.size() < 255; ++b)
+			k |= uint64_t((unsigned char)name[common + b]) << (48 - 8 * b);
+		keys[i] = {k, i};
+	}
+	if (n >= RADIX_SORT_MIN) {
+		// Least significant byte first; each pass is stable, so equal keys
+		// stay in directory order. Passes where every key has the same
+		// byte are skipped.
+		std::vector<Key> tmp(n);
+		for (int shift = 0; shift < 64; shift += 8) {
+			size_t count[256] = {0};
+			for (const auto & k : keys)
+				++count[(k.key >> shift) & 0xFF];
+			if (count[(keys[0].key >> shift) & 0xFF] == n) continue;
+			size_t pos = 0;
+			for (auto & c : count) {
+				size_t next = pos + c;
+				c = pos;
+				pos = next;
+			}
+			for (const auto & k : keys)
+				tmp[count[(k.key >> shift) & 0xFF]++] = k;
+			keys.swap(tmp);
+		}
+	} else {
+		std::sort(keys.begin(), keys.end(), [](const Key & a, const Key & b) {
+			return a.key < b.key || (a.key == b.key && a.index < b.index);
+		});
+	}
+	// Names longer than common + 7 bytes can differ past their keys.
+	for (size_t a = 0; a < n; ) {
+		size_t b = a + 1;
+		while (b < n && keys[b].key == keys[a].key) ++b;
+		if (b - a > 1 && ((keys[a].key >> 56) > common + 7 || (keys[a].key >> 56) == 255)) {
+			std::stable_sort(keys.begin() + a, keys.begin() + b, [&](const Key & x, const Key & y) {
+				return num_cmp(files[x.index], files[y.index]);
+			});
+		}
+		a = b;
+	}
+	std::vector<FileEntry> sorted;
+	sorted.reserve(n);
+	for (const auto & k : keys)
+		sorted.push_back(std::move(files[k.index]));
+	files.swap(sorted);
+}
+
+static bool write_all(int fd, const char * buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		count_write(n);
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool write_all(int fd, const std::string & str) {
+	return write_all(fd, str.data(), str.size());
+}
+
+// Pool of fixed-size, page-aligned chunks that every payload copy borrows
+// its buffer from, so memory use does not grow with entry sizes and the
+// allocator is only hit until the pool has warmed up. Acquiring never
+// waits: with every chunk lent out a new one is allocated, and chunks
+// handed back beyond the limit are freed, as callers on other threads
+// could otherwise wait on each other for good.
+class BufferPool {
+public:
+	static const size_t CHUNK_SIZE = COPY_BLOCK_SIZE;
+
+	// A borrowed chunk, handed back to the pool when destroyed.
+	class Chunk {
+	public:
+		Chunk() = default;
+		Chunk(Chunk && o) noexcept : pool(o.pool), ptr(o.ptr) { o.ptr = nullptr; }
+		Chunk & operator=(Chunk && o) noexcept {
+			if (this != &o) {
+				reset();
+				pool = o.pool;
+				ptr = o.ptr;
+				o.ptr = nullptr;
+			}
+			return *this;
+		}
+		~Chunk() { reset(); }
+		char * data() const { return ptr; }
+		static size_t size() { return CHUNK_SIZE; }
+		explicit operator bool() const { return ptr != nullptr; }
+		void reset() {
+			if (ptr) pool->release(ptr);
+			ptr = nullptr;
+		}
+
+	private:
+		friend class BufferPool;
+		Chunk(BufferPool * pool, char * ptr) : pool(pool), ptr(ptr) {}
+		BufferPool * pool = nullptr;
+		char * ptr = nullptr;
+	};
+
+	explicit BufferPool(size_t limit) : limit(limit) {}
+	BufferPool(const BufferPool &) = delete;
+	BufferPool & operator=(const BufferPool &) = delete;
+	~BufferPool() {
+		for (char * p : free_chunks)
+			free(p);
+	}
+
+	// Returns an empty chunk if memory runs out.
+	Chunk acquire() {
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (!free_chunks.empty()) {
+				char * p = free_chunks.back();
+				free_chunks.pop_back();
+				return Chunk(this, p);
+			}
+		}
+		void * p = nullptr;
+		if (posix_memalign(&p, 4096, CHUNK_SIZE) != 0)
+			return Chunk();
+		return Chunk(this, static_cast<char *>(p));
+	}
+
+	// Lets the pool keep at least n chunks, never fewer than before.
+	void grow(size_t n) {
+		std::lock_guard<std::mutex> l(lock);
+		limit = std::max(limit, n);
+	}
+
+private:
+	void release(char * p) {
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (free_chunks.size() < limit) {
+				free_chunks.push_back(p);
+				return;
+			}
+		}
+		free(p);
+	}
+
+	std::mutex lock;
+	std::vector<char *> free_chunks;
+	size_t limit;
+};
+
+// The pool keeps enough chunks for the prefetch ring of write_payloads
+// plus the copies the writing thread does itself, for the most jobs any
+// caller in this process has asked for so far.
+static BufferPool & buffer_pool() {
+	static BufferPool pool(0);
+	pool.grow(2 * lbr_options().jobs + 2);
+	return pool;
+}
+
+// Copy length bytes starting at offset in in_fd to the current position of
+// out_fd. The position of in_fd is left alone. Tries the in-kernel paths
+// first and falls back to moving aligned blocks through a user buffer.
+static bool copy_range(int in_fd, off_t offset, int out_fd, off_t length) {
+#ifdef __linux__
+	while (length > 0) {
+		ssize_t n = copy_file_range(in_fd, &offset, out_fd, NULL, length, 0);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) continue;
+			break; // EXDEV, ENOSYS, EINVAL, ... or unexpected EOF
+		}
+		count_read(n);
+		count_write(n);
+		length -= n;
+	}
+	while (length > 0) {
+		ssize_t n = sendfile(out_fd, in_fd, &offset, length);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) continue;
+			break;
+		}
+		count_read(n);
+		count_write(n);
+		length -= n;
+	}
+#endif
+	if (length == 0) return true;
+	BufferPool::Chunk buffer = buffer_pool().acquire();
+	if (!buffer) return false;
+	while (length > 0) {
+		size_t want = std::min<off_t>(length, buffer.size());
+		ssize_t n = pread(in_fd, buffer.data(), want, offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		count_read(n);
+		if (!write_all(out_fd, buffer.data(), n)) return false;
+		offset += n;
+		length -= n;
+	}
+	return true;
+}
+
+static off_t fd_size(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) return -1;
+	return st.st_size;
+}
+
+// Directory entry for a file added to an archive under its file name.
+static std::string make_dir_entry(const std::string & name, uint64_t length, bool strip_extension) {
+	std::string entry;
+	std::string ext = std::filesystem::path(name).extension();
+	std::transform(ext.begin(), ext.end(), ext.begin(),
+		[](auto c){ return std::tolower(c); });
+	if (strip_extension) {
+		size_t dot = name.find_last_of(".");
+		if (dot == std::string::npos)
+			entry += ascii2petscii(name);
+		else
+			entry += ascii2petscii(name.substr(0, dot));
+	} else
+		entry += ascii2petscii(name);
+	entry += 0x0D;
+	if (length == 0)
+		entry += 'D';
+	else {
+		if (ext == ".prg")
+			entry += 'P';
+		else if (ext == ".usr")
+			entry += 'U';
+		else if (ext == ".rel")
+			entry += 'R';
+		else
+			entry += 'S';
+	}
+	entry += 0x0D;
+	entry += 0x20;
+	entry += std::to_string(length);
+	entry += 0x20;
+	entry += 0x0D;
+	return entry;
+}
+
+// Runs work(i) for every i below count on up to threads threads. Each
+// thread takes the next i as it becomes free.
+template <typename F>
+static void parallel_for(int threads, size_t count, F work) {
+	if (threads <= 1 || count <= 1) {
+		for (size_t i = 0; i < count; ++i)
+			work(i);
+		return;
+	}
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> pool;
+	const LbrOptions & opts = lbr_options();
+	int phase = current_phase;
+	for (int t = 0; t < threads && (size_t)t < count; ++t) {
+		pool.emplace_back([&]() {
+			LbrOptionsScope scope(opts);
+			current_phase = phase;
+			for (size_t i; (i = next++) < count; )
+				work(i);
+		});
+	}
+	for (auto & t : pool)
+		t.join();
+}
+
+// A piece of a rewritten archive: either literal bytes, or a byte range of
+// the archive itself (path empty) or of another file.
+struct Segment {
+	std::string data;
+	std::string path;
+	off_t offset = 0;
+	off_t length = 0;
+};
+
+static void add_literal(std::vector<Segment> & segs, const std::string & data) {
+	if (data.empty()) return;
+	if (!segs.empty() && !segs.back().data.empty()) {
+		segs.back().data += data;
+		return;
+	}
+	Segment s;
+	s.data = data;
+	segs.push_back(s);
+}
+
+static void add_range(std::vector<Segment> & segs, off_t offset, off_t length, std::string path = "") {
+	if (length <= 0) return;
+	if (!segs.empty() && segs.back().data.empty() && segs.back().path == path
+		&& segs.back().offset + segs.back().length == offset) {
+		segs.back().length += length;
+		return;
+	}
+	Segment s;
+	s.path = path;
+	s.offset = offset;
+	s.length = length;
+	segs.push_back(s);
+}
+
+static bool write_segments(int arc, const std::vector<Segment> & segs, int out) {
+	for (const auto & s : segs) {
+		if (!s.data.empty()) {
+			if (!write_all(out, s.data)) return false;
+		} else if (s.path.empty()) {
+			if (!copy_range(arc, s.offset, out, s.length)) return false;
+		} else {
+			int in = open(s.path.c_str(), O_RDONLY);
+			if (in < 0) return false;
+			bool ok = copy_range(in, s.offset, out, s.length);
+			close(in);
+			if (!ok) return false;
+		}
+	}
+	return true;
+}
+
+// Which way a list of segments moves archive ranges, when it can be
+// applied in place at all.
+enum class Splice {
+	None, // needs a temporary copy
+	Patch, // no range moves, only literals are written over
+	Left, // every range moves towards the start, or stays
+	Right // every range moves towards the end, or stays
+};
+
+// The segments can be applied to the archive in place when they read
+// archive ranges in ascending order and all of those ranges move the same
+// way. Left moves are done front to back, so a literal or file range can
+// only be written once no later range still has to read from under it.
+// Right moves are done back to front, and everything else is written
+// after all ranges have moved.
+static Splice splice_direction(const std::vector<Segment> & segs) {
+	off_t pos = 0;
+	off_t src = 0;
+	bool left = true, right = true;
+	for (const auto & s : segs) {
+		if (!s.path.empty() || !s.data.empty()) {
+			pos += s.data.empty() ? s.length : s.data.size();
+			continue;
+		}
+		if (s.offset < src)
+			return Splice::None;
+		if (pos > s.offset) left = false;
+		if (pos < s.offset) right = false;
+		pos += s.length;
+		src = s.offset + s.length;
+	}
+	if (left && right) return Splice::Patch;
+	return left ? Splice::Left : right ? Splice::Right : Splice::None;
+}
+
+static bool pwrite_all(int fd, const char * buf, size_t len, off_t pos) {
+	for (size_t done = 0; done < len; ) {
+		ssize_t w = pwrite(fd, buf + done, len - done, pos + done);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return false;
+		count_write(w);
+		done += w;
+	}
+	return true;
+}
+
+// Move length bytes at from down to to (to <= from) in large blocks.
+static bool shift_left(int fd, off_t from, off_t to, off_t length) {
+	if (from == to) return true;
+	BufferPool::Chunk buffer = buffer_pool().acquire();
+	if (!buffer) return false;
+	while (length > 0) {
+		size_t want = std::min<off_t>(length, buffer.size());
+		ssize_t n = pread(fd, buffer.data(), want, from);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		count_read(n);
+		if (!pwrite_all(fd, buffer.data(), n, to)) return false;
+		from += n;
+		to += n;
+		length -= n;
+	}
+	return true;
+}
+
+// Move length bytes at from up to to (to >= from) in large blocks, last
+// block first.
+static bool shift_right(int fd, off_t from, off_t to, off_t length) {
+	if (from == to) return true;
+	BufferPool::Chunk buffer = buffer_pool().acquire();
+	if (!buffer) return false;
+	while (length > 0) {
+		size_t want = std::min<off_t>(length, buffer.size());
+		off_t at = length - want;
+		for (size_t done = 0; done < want; ) {
+			ssize_t n = pread(fd, buffer.data() + done, want - done, from + at + done);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			count_read(n);
+			done += n;
+		}
+		if (!pwrite_all(fd, buffer.data(), want, to + at)) return false;
+		length -= want;
+	}
+	return true;
+}
+
+// Opens a gap of length bytes at offset, moving everything after it up.
+// Filesystems that can insert whole blocks into a file do so for aligned
+// gaps, otherwise the tail is moved.
+static bool insert_gap(int fd, off_t offset, off_t length) {
+	off_t size = fd_size(fd);
+	if (size < 0) return false;
+#if defined(__linux__) && defined(FALLOC_FL_INSERT_RANGE)
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_blksize > 0 && offset < size
+		&& offset % st.st_blksize == 0 && length % st.st_blksize == 0
+		&& fallocate(fd, FALLOC_FL_INSERT_RANGE, offset, length) == 0)
+		return true;
+#endif
+	return shift_right(fd, offset, offset + length, size - offset);
+}
+
+// Writes a range of another file at pos.
+static bool write_file_range(int fd, const Segment & s, off_t pos) {
+	int in = open(s.path.c_str(), O_RDONLY);
+	if (in < 0) return false;
+	bool ok = lseek(fd, pos, SEEK_SET) == pos && copy_range(in, s.offset, fd, s.length);
+	close(in);
+	return ok;
+}
+
+static bool splice_in_place(int fd, const std::vector<Segment> & segs, Splice dir) {
+	std::vector<off_t> out(segs.size());
+	off_t pos = 0;
+	for (size_t i = 0; i < segs.size(); ++i) {
+		out[i] = pos;
+		pos += segs[i].data.empty() ? segs[i].length : segs[i].data.size();
+	}
+	auto write_other = [&](size_t i) {
+		const Segment & s = segs[i];
+		if (!s.data.empty())
+			return pwrite_all(fd, s.data.data(), s.data.size(), out[i]);
+		return write_file_range(fd, s, out[i]);
+	};
+	if (dir == Splice::Left || dir == Splice::Patch) {
+		for (size_t i = 0; i < segs.size(); ++i) {
+			const Segment & s = segs[i];
+			bool ok = s.data.empty() && s.path.empty()
+				? shift_left(fd, s.offset, out[i], s.length) : write_other(i);
+			if (!ok) return false;
+		}
+	} else {
+		off_t size = fd_size(fd);
+		for (size_t i = segs.size(); i-- > 0; ) {
+			const Segment & s = segs[i];
+			if (!s.data.empty() || !s.path.empty()) continue;
+			bool ok = s.offset + s.length == size
+				? insert_gap(fd, s.offset, out[i] - s.offset)
+				: shift_right(fd, s.offset, out[i], s.length);
+			if (!ok) return false;
+			size = std::max(size, out[i] + s.length);
+		}
+		for (size_t i = 0; i < segs.size(); ++i) {
+			const Segment & s = segs[i];
+			if ((!s.data.empty() || !s.path.empty()) && !write_other(i))
+				return false;
+		}
+	}
+	return fd_size(fd) == pos || ftruncate(fd, pos) == 0;
+}
+
+// Opens a new temporary file next to path, so it can later be renamed
+// over it on the same filesystem.
+static int open_sibling_temp(std::string path, std::string & tmp_path) {
+	std::filesystem::path p(path);
+	std::filesystem::path tmpl = p.parent_path() / ("." + p.filename().string() + ".XXXXXX");
+	tmp_path = tmpl.string();
+	int fd = mkstemp(&tmp_path[0]);
+	if (fd < 0) tmp_path.clear();
+	return fd;
+}
+
+// Makes the temporary file durable and moves it over path, which is then
+// either the old or the new archive, never anything in between. Closes fd.
+// The new file takes over the permissions of mode_from if it is >= 0.
+// Without durable the file is only renamed, with nothing synced.
+static bool commit_sibling_temp(int fd, std::string tmp_path, std::string path, int mode_from,
+	bool durable = true) {
+	PhaseTimer timer(LBR_PHASE_SYNC);
+	bool ok = true;
+	struct stat st;
+	if (mode_from >= 0 && fstat(mode_from, &st) == 0) {
+		fchmod(fd, st.st_mode & 07777);
+		if (fchown(fd, st.st_uid, st.st_gid) != 0) {} // best effort
+	} else {
+		// mkstemp creates 0600, archives get the usual 0666 & ~umask.
+		mode_t mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+	ok = !durable || fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+	ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+	if (!ok) {
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	if (!durable) return true;
+	// Make the rename itself durable.
+	std::filesystem::path parent = std::filesystem::path(path).parent_path();
+	int dir = open(parent.empty() ? "." : parent.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dir >= 0) {
+		fsync(dir);
+		close(dir);
+	}
+	return true;
+}
+
+// Replace the archive with the given segments. Normally the new archive
+// is written to a temporary file next to it, which is then renamed over
+// it. Edits that only write over bytes in place, without moving anything,
+// are done directly, as are all edits splice_in_place can do when
+// in_place is set (faster, but not safe against crashes).
+static int rewrite_lbr(std::string file, const std::vector<Segment> & segs) {
+	std::error_code ec;
+	std::filesystem::path real = std::filesystem::canonical(file, ec);
+	if (!ec) file = real.string();
+	Splice dir = splice_direction(segs);
+	off_t total = 0;
+	for (const auto & s : segs)
+		total += s.data.empty() ? s.length : s.data.size();
+	if (dir == Splice::Patch && (off_t)std::filesystem::file_size(file, ec) != total)
+		dir = Splice::Left;
+	if (dir == Splice::Patch || (lbr_options().in_place && dir != Splice::None)) {
+		int fd = open(file.c_str(), O_RDWR);
+		bool ok = fd >= 0;
+		if (ok) {
+			PhaseTimer timer(LBR_PHASE_REWRITE);
+			ok = splice_in_place(fd, segs, dir);
+		}
+		if (ok) {
+			PhaseTimer timer(LBR_PHASE_SYNC);
+			ok = fsync(fd) == 0;
+		}
+		if (!ok) {
+			if (fd >= 0) close(fd);
+			lbr_log() << "Error writing archive." << std::endl;
+			return LBR_WRITE_ERROR;
+		}
+		close(fd);
+		return LBR_OK;
+	}
+	int arc = open(file.c_str(), O_RDONLY);
+	if (arc < 0) {
+		lbr_log() << "Error reading from archive." << std::endl;
+		return LBR_READ_ERROR;
+	}
+	std::string tmp_path;
+	int tmp = open_sibling_temp(file, tmp_path);
+	if (tmp < 0) {
+		close(arc);
+		lbr_log() << "Error writing archive." << std::endl;
+		return LBR_WRITE_ERROR;
+	}
+	bool written;
+	{
+		PhaseTimer timer(LBR_PHASE_REWRITE);
+		written = write_segments(arc, segs, tmp);
+	}
+	if (!written) {
+		close(arc);
+		close(tmp);
+		unlink(tmp_path.c_str());
+		lbr_log() << "Error reading from archive." << std::endl;
+		return LBR_READ_ERROR;
+	}
+	bool ok = commit_sibling_temp(tmp, tmp_path, file, arc);
+	close(arc);
+	if (!ok) {
+		lbr_log() << "Error writing archive." << std::endl;
+		return LBR_WRITE_ERROR;
+	}
+	return LBR_OK;
+}
+
+// Writes the payloads of files to out, in order. Each payload is length
+// bytes at offset in the file at path, or in spool if path is empty. With
+// more than one job, reader threads open and read upcoming files into a
+// bounded ring of slots while this thread writes out the ones before them.
+// Each slot holds one pooled chunk; files too big for it are copied
+// straight from their file by the writer.
+static bool write_payloads(int out, const std::vector<FileEntry> & files, int spool = -1) {
+	PhaseTimer timer(LBR_PHASE_COPY);
+	std::vector<const FileEntry *> todo;
+	for (const auto & f : files) {
+		if (f.length > 0) todo.push_back(&f);
+	}
+	auto read_fully = [](int fd, char * buf, size_t len, off_t offset) {
+		for (size_t done = 0; done < len; ) {
+			ssize_t n = pread(fd, buf + done, len - done, offset + done);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			count_read(n);
+			done += n;
+		}
+		return true;
+	};
+	auto source = [&](const FileEntry & f) {
+		return f.path.empty() ? spool : open(f.path.c_str(), O_RDONLY);
+	};
+	auto release = [&](const FileEntry & f, int fd) {
+		if (fd >= 0 && !f.path.empty()) close(fd);
+	};
+	auto report = [](const FileEntry & f) {
+		if (f.path.empty())
+			lbr_log() << "Error reading spooled entry: " << f.name << std::endl;
+		else
+			lbr_log() << "Error reading file: " << f.path << std::endl;
+	};
+#ifdef LBR_IO_URING
+	// Small files are gathered into batches: their opens, then their reads
+	// into pooled chunks, then their closes each go to the kernel as a
+	// single submission, and the batch is written out chunk by chunk.
+	// Spooled and big entries are copied as below.
+	IoRing uring;
+	if (todo.size() > 1 && uring.init(URING_DEPTH)) {
+		const size_t max_chunks = URING_BATCH_BYTES / BufferPool::CHUNK_SIZE;
+		std::vector<BufferPool::Chunk> chunks; // kept for every batch
+		std::vector<size_t> used; // bytes of each chunk the batch fills
+		std::vector<const FileEntry *> group;
+		std::vector<size_t> at, pos; // chunk and offset in it of each entry
+		auto flush = [&]() {
+			std::vector<int> fds(group.size(), -1);
+			std::vector<int> got(group.size(), -1);
+			for (size_t i = 0; i < group.size(); ++i)
+				uring.openat(group[i]->path.c_str(), O_RDONLY, 0, i);
+			bool ok = uring.run([&](uint64_t i, int res) { fds[i] = res; });
+			for (size_t i = 0; ok && i < group.size(); ++i) {
+				if (fds[i] >= 0)
+					uring.read(fds[i], chunks[at[i]].data() + pos[i], group[i]->length, group[i]->offset, i);
+			}
+			ok = ok && uring.run([&](uint64_t i, int res) { got[i] = res; });
+			size_t good = 0; // entries read in full, in order
+			for (; ok && good < group.size(); ++good) {
+				const FileEntry & f = *group[good];
+				int n = got[good];
+				if (fds[good] < 0 || n < 0) break;
+				count_read(n);
+				if ((uint64_t)n < f.length
+					&& !read_fully(fds[good], chunks[at[good]].data() + pos[good] + n, f.length - n, f.offset + n))
+					break;
+			}
+			for (size_t i = 0; i < group.size(); ++i) {
+				if (fds[i] >= 0 && (!ok || !uring.close(fds[i], i))) close(fds[i]);
+			}
+			uring.run([](uint64_t, int) {});
+			// Chunks are filled from the start, so everything up to the end
+			// of the last good entry of each makes up the payloads in order.
+			bool written = true;
+			for (size_t c = 0, i = 0; written && c < used.size(); ++c) {
+				size_t len = 0;
+				for (; i < good && at[i] == c; ++i)
+					len = pos[i] + group[i]->length;
+				written = len == 0 || write_all(out, chunks[c].data(), len);
+			}
+			ok = written && good == group.size();
+			if (!ok)
+				report(*group[std::min(good, group.size() - 1)]);
+			group.clear();
+			at.clear();
+			pos.clear();
+			used.clear();
+			return ok;
+		};
+		for (const auto * f : todo) {
+			if (f->path.empty() || f->length > BufferPool::CHUNK_SIZE) {
+				if (!group.empty() && !flush()) return false;
+				int in = source(*f);
+				bool ok = in >= 0 && copy_range(in, f->offset, out, f->length);
+				release(*f, in);
+				if (!ok) {
+					report(*f);
+					return false;
+				}
+				continue;
+			}
+			bool next_chunk = used.empty() || used.back() + f->length > BufferPool::CHUNK_SIZE;
+			if (group.size() == URING_DEPTH || (next_chunk && used.size() == max_chunks)) {
+				if (!flush()) return false;
+				next_chunk = true;
+			}
+			if (next_chunk) {
+				if (chunks.size() == used.size())
+					chunks.push_back(buffer_pool().acquire());
+				if (!chunks[used.size()]) {
+					report(*f);
+					return false;
+				}
+				used.push_back(0);
+			}
+			group.push_back(f);
+			at.push_back(used.size() - 1);
+			pos.push_back(used.back());
+			used.back() += f->length;
+		}
+		return group.empty() || flush();
+	}
+#endif
+	if (lbr_options().jobs <= 1 || todo.size() <= 1) {
+		for (const auto * f : todo) {
+			int in = source(*f);
+			bool ok = in >= 0 && copy_range(in, f->offset, out, f->length);
+			release(*f, in);
+			if (!ok) {
+				report(*f);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	struct Slot {
+		BufferPool::Chunk data;
+		size_t used = 0;
+		int fd = -1; // files too big for the slot are left open for the writer
+		bool ready = false;
+		bool ok = true;
+	};
+	const size_t ring_size = lbr_options().jobs * 2;
+	std::vector<Slot> ring(ring_size);
+	std::mutex lock;
+	std::condition_variable slot_free, slot_ready;
+	size_t next = 0; // next file for a reader to claim
+	size_t written = 0; // files the writer is done with
+	bool abort = false;
+
+	const LbrOptions & opts = lbr_options();
+	int phase = current_phase;
+	auto reader = [&]() {
+		LbrOptionsScope scope(opts);
+		current_phase = phase;
+		for (;;) {
+			size_t k;
+			{
+				std::unique_lock<std::mutex> l(lock);
+				slot_free.wait(l, [&]() { return abort || next >= todo.size() || next < written + ring_size; });
+				if (abort || next >= todo.size()) return;
+				k = next++;
+			}
+			Slot & slot = ring[k % ring_size];
+			const FileEntry & f = *todo[k];
+			int in = source(f);
+			bool ok = in >= 0;
+			if (ok && f.length <= BufferPool::CHUNK_SIZE) {
+				if (!slot.data)
+					slot.data = buffer_pool().acquire();
+				slot.used = f.length;
+				ok = slot.data && read_fully(in, slot.data.data(), f.length, f.offset);
+				release(f, in);
+			} else
+				slot.fd = in;
+			std::lock_guard<std::mutex> l(lock);
+			slot.ok = ok;
+			slot.ready = true;
+			slot_ready.notify_all();
+		}
+	};
+	std::vector<std::thread> readers;
+	for (int t = 0; t < lbr_options().jobs; ++t)
+		readers.emplace_back(reader);
+
+	bool ok = true;
+	for (size_t k = 0; k < todo.size() && ok; ++k) {
+		Slot & slot = ring[k % ring_size];
+		{
+			std::unique_lock<std::mutex> l(lock);
+			slot_ready.wait(l, [&]() { return slot.ready; });
+		}
+		const FileEntry & f = *todo[k];
+		ok = slot.ok;
+		if (ok) {
+			if (slot.fd >= 0)
+				ok = copy_range(slot.fd, f.offset, out, f.length);
+			else
+				ok = write_all(out, slot.data.data(), slot.used);
+		}
+		if (!ok)
+			report(f);
+		release(f, slot.fd);
+		std::lock_guard<std::mutex> l(lock);
+		slot.fd = -1;
+		slot.ready = false;
+		written = k + 1;
+		abort = !ok;
+		slot_free.notify_all();
+	}
+	for (auto & t : readers)
+		t.join();
+	// Close whatever was prefetched past a failure.
+	for (auto & slot : ring) {
+		if (slot.fd >= 0 && slot.fd != spool)
+			close(slot.fd);
+	}
+	return ok;
+}
+
+LbrWriter::~LbrWriter() {
+	if (spool >= 0) close(spool);
+}
+
+bool LbrWriter::add_file(const std::string & path, bool strip_extension) {
+	std::error_code ec;
+	FileEntry f;
+	f.name = std::filesystem::path(path).filename();
+	f.path = path;
+	f.length = std::filesystem::file_size(path, ec);
+	if (ec) {
+		lbr_log() << "File not found: " << path << std::endl;
+		return false;
+	}
+	return add_file(f, strip_extension);
+}
+
+bool LbrWriter::add_file(const FileEntry & f, bool strip_extension) {
+	dir += make_dir_entry(f.name, f.length, strip_extension);
+	files.push_back(f);
+	files.back().offset = 0;
+	return true;
+}
+
+bool LbrWriter::add_buffer(const std::string & name, std::string_view data, std::string type) {
+	size_t done = 0;
+	return add_generated(name, [&](char * buf, size_t len) {
+		size_t n = std::min(len, data.size() - done);
+		std::copy(data.data() + done, data.data() + done + n, buf);
+		done += n;
+		return (ssize_t)n;
+	}, type);
+}
+
+bool LbrWriter::add_generated(const std::string & name, Generator gen, std::string type) {
+	PhaseTimer timer(LBR_PHASE_COPY);
+	if (!open_spool()) return false;
+	BufferPool::Chunk chunk = buffer_pool().acquire();
+	if (!chunk) return false;
+	FileEntry f;
+	f.name = name;
+	f.offset = spooled;
+	for (;;) {
+		ssize_t n = gen(chunk.data(), BufferPool::CHUNK_SIZE);
+		if (n < 0) {
+			lbr_log() << "Error generating entry: " << name << std::endl;
+			return false;
+		}
+		if (n == 0) break;
+		if (!write_all(spool, chunk.data(), n)) {
+			lbr_log() << "Error writing spool file." << std::endl;
+			return false;
+		}
+		f.length += n;
+	}
+	spooled += f.length;
+	add_entry(f, f.length == 0 ? "D" : type);
+	return true;
+}
+
+void LbrWriter::add_deleted(const std::string & name) {
+	FileEntry f;
+	f.name = name;
+	add_entry(f, "D");
+}
+
+bool LbrWriter::finish() {
+	std::string header = "DWB ";
+	header += std::to_string(files.size());
+	header += " \x0D";
+	std::string tmp_path;
+	int out = open_sibling_temp(outfile, tmp_path);
+	if (out < 0) {
+		lbr_log() << "Error writing archive." << std::endl;
+		return false;
+	}
+	if (!write_all(out, header) || !write_all(out, dir) || !write_payloads(out, files, spool)) {
+		close(out);
+		unlink(tmp_path.c_str());
+		lbr_log() << "Error writing archive." << std::endl;
+		return false;
+	}
+	if (!commit_sibling_temp(out, tmp_path, outfile, -1)) {
+		lbr_log() << "Error writing archive." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void LbrWriter::add_entry(const FileEntry & f, const std::string & type) {
+	dir += ascii2petscii(f.name);
+	dir += 0x0D;
+	dir += type;
+	dir += 0x0D;
+	dir += 0x20;
+	dir += std::to_string(f.length);
+	dir += 0x20;
+	dir += 0x0D;
+	files.push_back(f);
+}
+
+bool LbrWriter::open_spool() {
+	if (spool >= 0) return true;
+	std::string tmp_path;
+	spool = open_sibling_temp(outfile, tmp_path);
+	if (spool < 0) {
+		lbr_log() << "Error creating spool file." << std::endl;
+		return false;
+	}
+	unlink(tmp_path.c_str());
+	return true;
+}
+
+// xxHash64, fed in pieces of any size.
+class Xxh64 {
+public:
+	explicit Xxh64(uint64_t seed = 0) : seed(seed) {
+		v[0] = seed + P1 + P2;
+		v[1] = seed + P2;
+		v[2] = seed;
+		v[3] = seed - P1;
+	}
+
+	void update(const char * p, size_t len) {
+		total += len;
+		if (buffered + len < 32) {
+			memcpy(buf + buffered, p, len);
+			buffered += len;
+			return;
+		}
+		if (buffered) {
+			size_t fill = 32 - buffered;
+			memcpy(buf + buffered, p, fill);
+			stripe(buf);
+			p += fill;
+			len -= fill;
+			buffered = 0;
+		}
+		for (; len >= 32; p += 32, len -= 32)
+			stripe(p);
+		memcpy(buf, p, len);
+		buffered = len;
+	}
+
+	uint64_t digest() const {
+		uint64_t h;
+		if (total >= 32) {
+			h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+			for (int i = 0; i < 4; ++i)
+				h = (h ^ round(0, v[i])) * P1 + P4;
+		} else
+			h = seed + P5;
+		h += total;
+		const char * p = buf;
+		size_t len = buffered;
+		for (; len >= 8; p += 8, len -= 8)
+			h = rotl(h ^ round(0, load<uint64_t>(p)), 27) * P1 + P4;
+		if (len >= 4) {
+			h = rotl(h ^ (load<uint32_t>(p) * P1), 23) * P2 + P3;
+			p += 4;
+			len -= 4;
+		}
+		for (; len > 0; ++p, --len)
+			h = rotl(h ^ ((unsigned char)*p * P5), 11) * P1;
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static const uint64_t P1 = 0x9E3779B185EBCA87ull;
+	static const uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+	static const uint64_t P3 = 0x165667B19E3779F9ull;
+	static const uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+	static const uint64_t P5 = 0x27D4EB2F165667C5ull;
+
+	static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+	static uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; }
+	template <typename T>
+	static T load(const char * p) {
+		T x;
+		memcpy(&x, p, sizeof(x)); // little endian hosts only
+		return x;
+	}
+	void stripe(const char * p) {
+		for (int i = 0; i < 4; ++i)
+			v[i] = round(v[i], load<uint64_t>(p + 8 * i));
+	}
+
+	uint64_t seed;
+	uint64_t v[4];
+	uint64_t total = 0;
+	char buf[32];
+	size_t buffered = 0;
+};
+
+// A payload to compare: length bytes at offset in the file at path, or in
+// fd if path is empty.
+struct DedupSource {
+	std::string path;
+	int fd = -1;
+	uint64_t offset = 0;
+	uint64_t length = 0;
+};
+
+// Reads all of s in pooled chunks, handing each to use. False on errors.
+template <typename F>
+static bool read_source(const DedupSource & s, BufferPool::Chunk & chunk, F use) {
+	int fd = s.path.empty() ? s.fd : open(s.path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	bool ok = true;
+	for (uint64_t done = 0; ok && done < s.length; ) {
+		size_t want = std::min<uint64_t>(chunk.size(), s.length - done);
+		ssize_t n = pread(fd, chunk.data(), want, s.offset + done);
+		if (n < 0 && errno == EINTR) continue;
+		ok = n > 0 && use(chunk.data(), n);
+		if (ok) count_read(n);
+		done += ok ? n : 0;
+	}
+	if (!s.path.empty()) close(fd);
+	return ok;
+}
+
+static void report_duplicate(const std::string & name, const std::string & first) {
+	if (lbr_options().dedup == LbrDedup::Skip)
+		lbr_log() << "Skipped " << name << ", same as " << first << std::endl;
+	else
+		lbr_log() << "Same contents: " << name << " and " << first << std::endl;
+}
+
+// For every source from first_new on, the index of the first source before
+// it with the same contents, or -1. Only payloads whose length some other
+// one shares are hashed, on up to LbrOptions::jobs threads, and equal
+// hashes are then compared byte by byte. Empty payloads never match.
+static std::vector<long> find_duplicates(const std::vector<DedupSource> & sources, size_t first_new = 0) {
+	PhaseTimer timer(LBR_PHASE_HASH);
+	std::vector<long> same(sources.size(), -1);
+	std::unordered_map<uint64_t, std::vector<size_t>> by_length;
+	for (size_t i = 0; i < sources.size(); ++i) {
+		if (sources[i].length > 0)
+			by_length[sources[i].length].push_back(i);
+	}
+	std::vector<size_t> candidates;
+	for (const auto & l : by_length) {
+		if (l.second.size() > 1 && l.second.back() >= first_new)
+			candidates.insert(candidates.end(), l.second.begin(), l.second.end());
+	}
+	std::sort(candidates.begin(), candidates.end());
+	std::vector<uint64_t> hashes(candidates.size());
+	std::vector<char> readable(candidates.size());
+	parallel_for(lbr_options().jobs, candidates.size(), [&](size_t k) {
+		BufferPool::Chunk chunk = buffer_pool().acquire();
+		Xxh64 h;
+		readable[k] = chunk && read_source(sources[candidates[k]], chunk, [&](const char * p, size_t n) {
+			h.update(p, n);
+			return true;
+		});
+		hashes[k] = h.digest();
+	});
+	auto identical = [](const DedupSource & a, const DedupSource & b) {
+		BufferPool::Chunk ca = buffer_pool().acquire(), cb = buffer_pool().acquire();
+		if (!ca || !cb) return false;
+		DedupSource rest = b;
+		return read_source(a, ca, [&](const char * p, size_t n) {
+			DedupSource part = rest;
+			part.length = n;
+			bool ok = read_source(part, cb, [&](const char * q, size_t m) {
+				return memcmp(p, q, m) == 0;
+			});
+			rest.offset += n;
+			return ok;
+		});
+	};
+	// First source seen with each hash and length; distinct contents with
+	// the same hash are vanishingly rare and only cost a missed match.
+	std::unordered_map<uint64_t, std::unordered_map<uint64_t, size_t>> first;
+	for (size_t k = 0; k < candidates.size(); ++k) {
+		size_t i = candidates[k];
+		if (!readable[k]) continue;
+		auto res = first[sources[i].length].emplace(hashes[k], i);
+		if (!res.second && i >= first_new && identical(sources[res.first->second], sources[i]))
+			same[i] = res.first->second;
+	}
+	return same;
+}
+
+int build_lbr(std::string outfile, std::vector<std::string> input,
+	bool numerical_sort, bool numerical_padding, bool strip_extension) {
+
+	// Stat every input at once, there is nothing to order yet.
+	std::vector<FileEntry> files(input.size());
+	std::vector<char> missing(input.size());
+	parallel_for(lbr_options().jobs, input.size(), [&](size_t i) {
+		std::filesystem::path path(input[i]);
+		std::error_code ec;
+		files[i].name = path.filename();
+		files[i].path = input[i];
+		files[i].length = std::filesystem::file_size(path, ec);
+		missing[i] = bool(ec);
+	});
+	for (size_t i = 0; i < input.size(); ++i) {
+		if (missing[i]) {
+			lbr_log() << "File not found: " << input[i] << std::endl;
+			return LBR_NOT_FOUND;
+		}
+	}
+	if (lbr_options().dedup != LbrDedup::Off) {
+		std::vector<DedupSource> sources(files.size());
+		for (size_t i = 0; i < files.size(); ++i) {
+			sources[i].path = files[i].path;
+			sources[i].length = files[i].length;
+		}
+		std::vector<long> same = find_duplicates(sources);
+		std::vector<FileEntry> kept;
+		for (size_t i = 0; i < files.size(); ++i) {
+			if (same[i] >= 0)
+				report_duplicate(files[i].path, files[same[i]].path);
+			if (same[i] < 0 || lbr_options().dedup != LbrDedup::Skip)
+				kept.push_back(files[i]);
+		}
+		files.swap(kept);
+	}
+	if (numerical_sort) {
+		sort_numerically(files);
+		if (numerical_padding) {
+			std::string f_str = files.front().name;
+			int first = std::atoi(f_str.c_str());
+			std::string l_str = files.back().name;
+			int last = std::atoi(l_str.c_str());
+			if (last <= first) {
+				lbr_log() << "Error. unable to pad.";
+				return LBR_INVALID;
+			}
+			// One pass merging the files with the numbers missing between
+			// them, each gap filled with empty entries named by number.
+			std::vector<FileEntry> padded;
+			padded.reserve(std::max<size_t>(files.size(), last - first + 1));
+			size_t k = 0;
+			for (int i = first; i < last && k < files.size(); i++) {
+				int cur = std::atoi(files[k].name.c_str());
+				while (i < cur) {
+					FileEntry f;
+					f.name = std::to_string(i);
+					f.length = 0;
+					padded.push_back(f);
+					++i;
+				}
+				padded.push_back(std::move(files[k++]));
+			}
+			for (; k < files.size(); ++k)
+				padded.push_back(std::move(files[k]));
+			files.swap(padded);
+		}
+	}
+	LbrWriter writer(outfile);
+	for (const auto & a : files) {
+		if (lbr_options().verbose)
+			lbr_log() << "+ " << a.name;
+		writer.add_file(a, strip_extension);
+	}
+	if (!writer.finish())
+		return LBR_WRITE_ERROR;
+	return LBR_OK;
+}
+
+// Parses a decimal number that has to fill all of str, without overflow.
+bool parse_number(std::string_view str, uint64_t & value) {
+	value = 0;
+	auto res = std::from_chars(str.data(), str.data() + str.size(), value);
+	return !str.empty() && res.ec == std::errc() && res.ptr == str.data() + str.size();
+}
+
+// Parses the header and directory at the start of in. Each entry gets the
+// position of its directory entry and, as a running sum of the lengths
+// before it, of its payload. Stops early if in runs out, so the work is
+// bounded by the size of in, not by the count in the header.
+bool parse_directory(std::string_view in, LbrIndex & index) {
+	PhaseTimer timer(LBR_PHASE_PARSE);
+	index = LbrIndex();
+	if (in.size() < 3 || in.substr(0, 3) != "DWB")
+		return false;
+	size_t pos = std::min<size_t>(4, in.size()); // signature, space
+	// Returns the field starting at pos up to delim, and steps past the
+	// delimiter and skip more bytes.
+	auto field = [&](char delim, size_t skip) {
+		if (pos >= in.size()) {
+			index.truncated = true;
+			return std::string_view();
+		}
+		size_t end = in.find(delim, pos);
+		if (end == std::string_view::npos || end + 1 + skip > in.size())
+			index.truncated = true;
+		if (end == std::string_view::npos) end = in.size();
+		std::string_view f = in.substr(pos, end - pos);
+		pos = std::min(end + 1 + skip, in.size());
+		return f;
+	};
+	parse_number(field(0x20, 1), index.count); // space, cr
+	index.dir_start = pos;
+	// Room for entries of a typical size, not the smallest possible five
+	// bytes: a bogus count over data without delimiters should not get
+	// more memory than the entries really found in it need.
+	index.files.reserve(std::min<uint64_t>(index.count, (in.size() - pos) / 16 + 1));
+	for (uint64_t i = 0; i < index.count && pos < in.size(); ++i) {
+		FileEntry f;
+		f.dir_offset = pos;
+		f.name = field(0x0D, 0);
+		f.ascii_name = petscii2ascii(f.name);
+		f.type = field(0x0D, 1); // cr, space
+		if (!parse_number(field(0x20, 1), f.length) // space, cr
+			|| (lbr_options().max_length && f.length > lbr_options().max_length)) {
+			f.bad_length = true;
+			index.bad_length = true;
+		}
+		f.dir_length = pos - f.dir_offset;
+		index.files.push_back(f);
+	}
+	if (index.files.size() < index.count)
+		index.truncated = true;
+	index.data_start = pos;
+	uint64_t offset = pos;
+	for (auto & f : index.files) {
+		f.offset = offset;
+		offset += f.length;
+	}
+	index.data_end = offset;
+	return true;
+}
+
+// Hash index from converted names to entries of an LbrIndex, for looking up
+// many names. Entries sharing a name are chained in directory order. The
+// keys point into the LbrIndex, which must outlive this.
+class LbrNameIndex {
+public:
+	explicit LbrNameIndex(const LbrIndex & index);
+	// First entry called name, or -1.
+	long first(std::string_view name) const;
+	// Next entry with the same name as entry i, or -1.
+	long next(long i) const { return chain[i]; }
+
+private:
+	std::unordered_map<std::string_view, long> heads;
+	std::vector<long> chain;
+};
+
+LbrNameIndex::LbrNameIndex(const LbrIndex & index) : chain(index.files.size(), -1) {
+	heads.reserve(index.files.size());
+	std::vector<long> tails(index.files.size(), -1);
+	for (long i = 0; i < (long)index.files.size(); ++i) {
+		auto res = heads.emplace(index.files[i].ascii_name, i);
+		if (!res.second)
+			chain[tails[res.first->second]] = i;
+		tails[res.first->second] = i;
+	}
+}
+
+long LbrNameIndex::first(std::string_view name) const {
+	auto it = heads.find(name);
+	return it == heads.end() ? -1 : it->second;
+}
+
+// Read-only view of an archive, mapped into memory once. The directory is
+// scanned straight out of the mapping and payloads are handed out as views
+// into it, so nothing is copied until it is written somewhere.
+class LbrArchiveView {
+public:
+	LbrArchiveView() = default;
+	LbrArchiveView(const LbrArchiveView &) = delete;
+	LbrArchiveView & operator=(const LbrArchiveView &) = delete;
+	~LbrArchiveView() { close(); }
+
+	// Maps the file and scans the directory. Returns false when the file
+	// can not be mapped or does not have an LBR signature.
+	bool open(const std::string & path);
+	void close();
+
+	const LbrIndex & index() const { return idx; }
+	const std::vector<FileEntry> & entries() const { return idx.files; }
+	// All of the mapped archive.
+	std::string_view data() const { return std::string_view(map, size); }
+	// Payload of entry i, cut short if the archive is truncated.
+	std::string_view payload(const FileEntry & f) const;
+	// Everything from the payload of entry f to the end of the archive.
+	std::string_view remainder(const FileEntry & f) const;
+	// The archive itself, kept open for copying payloads in the kernel.
+	int fd() const { return file; }
+
+private:
+	bool scan();
+	int file = -1;
+	const char * map = nullptr;
+	size_t size = 0;
+	LbrIndex idx;
+};
+
+bool LbrArchiveView::open(const std::string & path) {
+	PhaseTimer timer(LBR_PHASE_PARSE);
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	off_t len = fd_size(fd);
+	if (len <= 0) {
+		::close(fd);
+		return false;
+	}
+	void * p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		::close(fd);
+		return false;
+	}
+	file = fd;
+	map = static_cast<const char *>(p);
+	size = len;
+	return scan();
+}
+
+void LbrArchiveView::close() {
+	if (map)
+		munmap(const_cast<char *>(map), size);
+	if (file >= 0)
+		::close(file);
+	file = -1;
+	map = nullptr;
+	size = 0;
+	idx = LbrIndex();
+}
+
+bool LbrArchiveView::scan() {
+	return parse_directory(data(), idx);
+}
+
+std::string_view LbrArchiveView::payload(const FileEntry & f) const {
+	if ((size_t)f.offset >= size) return std::string_view();
+	return data().substr(f.offset, f.length);
+}
+
+std::string_view LbrArchiveView::remainder(const FileEntry & f) const {
+	if ((size_t)f.offset >= size) return std::string_view();
+	return data().substr(f.offset);
+}
+
+// Writes length bytes of in_fd from offset to the file fp, copied in the
+// kernel where the file systems allow it.
+static bool write_file(std::filesystem::path fp, int in_fd, off_t offset, off_t length) {
+	int out = open(fp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) return false;
+	bool ok = copy_range(in_fd, offset, out, length);
+	return close(out) == 0 && ok;
+}
+
+// Forward-only reader for an archive coming in on a pipe.
+class LbrStream {
+public:
+	explicit LbrStream(int fd) : fd(fd) {}
+
+	// Reads just enough to parse the whole directory, reading more each
+	// time it falls short. Returns false without an LBR signature.
+	bool read_directory(LbrIndex & index);
+	// Copies length bytes from the current position to out, or everything
+	// up to the end when length is negative. With out < 0 the bytes are
+	// just skipped. Returns false if the stream ends first.
+	bool copy(int64_t length, int out);
+	// Archive offset of the next byte to be read.
+	uint64_t tell() const { return pos; }
+
+private:
+	int fd;
+	std::string buf; // read but not consumed yet
+	size_t buf_pos = 0;
+	uint64_t pos = 0;
+	bool eof = false;
+};
+
+bool LbrStream::read_directory(LbrIndex & index) {
+	PhaseTimer timer(LBR_PHASE_PARSE);
+	size_t want = 64*1024;
+	for (;;) {
+		while (!eof && buf.size() < want) {
+			size_t old = buf.size();
+			buf.resize(want);
+			ssize_t n = read(fd, &buf[old], want - old);
+			if (n < 0 && errno == EINTR) n = 0;
+			else if (n <= 0) eof = true;
+			count_read(n);
+			buf.resize(old + std::max<ssize_t>(n, 0));
+		}
+		if (!parse_directory(buf, index))
+			return false;
+		if (!index.truncated || eof) break;
+		want *= 2;
+	}
+	buf_pos = pos = index.data_start;
+	return true;
+}
+
+bool LbrStream::copy(int64_t length, int out) {
+	bool ok = true;
+	size_t avail = buf.size() - buf_pos;
+	size_t n = length < 0 ? avail : std::min<size_t>(avail, length);
+	if (out >= 0)
+		ok = write_all(out, buf.data() + buf_pos, n);
+	buf_pos += n;
+	pos += n;
+	if (length >= 0) length -= n;
+	if (buf_pos == buf.size()) {
+		buf.clear();
+		buf_pos = 0;
+	}
+	BufferPool::Chunk block;
+	while (ok && length != 0 && !eof) {
+		if (!block && !(block = buffer_pool().acquire()))
+			return false;
+		size_t want = length < 0 ? block.size() : std::min<size_t>(length, block.size());
+		ssize_t r = read(fd, block.data(), want);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) {
+			eof = true;
+			break;
+		}
+		count_read(r);
+		if (out >= 0)
+			ok = write_all(out, block.data(), r);
+		pos += r;
+		if (length > 0) length -= r;
+	}
+	return ok && length <= 0;
+}
+
+int read_stream_directory(int fd, LbrIndex & index) {
+	return LbrStream(fd).read_directory(index) ? LBR_OK : LBR_NOT_LBR;
+}
+
+// Sidecar index cache, ARCHIVE.idx: the parsed directory as fixed-size
+// records plus one block of strings, names already converted. It is
+// only used while the size, modification time and a hash of the whole
+// directory of the archive still match what it was made from, and is
+// rewritten otherwise.
+const char INDEX_MAGIC[8] = {'L', 'B', 'R', 'I', 'D', 'X', '2', 0};
+
+struct IndexKey {
+	uint64_t size = ~0ull;
+	int64_t mtime_sec = 0;
+	int64_t mtime_nsec = 0;
+	uint64_t hash = 0;
+};
+
+struct IndexHeader {
+	char magic[8];
+	IndexKey key;
+	uint64_t count;
+	uint64_t dir_start;
+	uint64_t data_start;
+	uint64_t data_end;
+	uint64_t files;
+	uint64_t strings;
+	uint32_t truncated;
+	uint32_t converted; // ascii names made with conversion on
+};
+
+struct IndexRecord {
+	uint64_t dir_offset;
+	uint64_t dir_length;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t name; // offsets into the strings, each followed by its size
+	uint32_t name_size;
+	uint32_t ascii;
+	uint32_t ascii_size;
+	uint32_t type;
+	uint32_t type_size;
+	uint32_t length_ok; // the length field parsed, whatever the limit
+	uint32_t pad;
+};
+
+static uint64_t directory_hash(std::string_view dir) {
+	Xxh64 h;
+	h.update(dir.data(), dir.size());
+	return h.digest();
+}
+
+// Hashes the first length bytes of fd, the directory an index was made of.
+static bool directory_hash(int fd, uint64_t length, uint64_t & hash) {
+	std::vector<char> block(COPY_BLOCK_SIZE);
+	Xxh64 h;
+	for (uint64_t pos = 0; pos < length; ) {
+		ssize_t n = pread(fd, block.data(), std::min<uint64_t>(block.size(), length - pos), pos);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		count_read(n);
+		h.update(block.data(), n);
+		pos += n;
+	}
+	hash = h.digest();
+	return true;
+}
+
+// The key but for the hash, which is of the directory and so only known
+// once that has been parsed, or taken from the index when loading it.
+static void index_key(const struct stat & st, IndexKey & key) {
+	key.size = st.st_size;
+	key.mtime_sec = st.st_mtim.tv_sec;
+	key.mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+// fd is the archive at path, for hashing its directory.
+static bool load_index_cache(const std::string & path, int fd, const IndexKey & key, LbrIndex & index) {
+	std::string idx = path + ".idx";
+	int idx_fd = open(idx.c_str(), O_RDONLY);
+	if (idx_fd < 0) return false;
+	off_t len = fd_size(idx_fd);
+	if (len < (off_t)sizeof(IndexHeader)) {
+		close(idx_fd);
+		return false;
+	}
+	void * p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, idx_fd, 0);
+	close(idx_fd);
+	if (p == MAP_FAILED) return false;
+	const char * map = static_cast<const char *>(p);
+	IndexHeader h;
+	memcpy(&h, map, sizeof(h));
+	uint64_t hash;
+	bool ok = memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) == 0
+		&& h.key.size == key.size && h.key.mtime_sec == key.mtime_sec
+		&& h.key.mtime_nsec == key.mtime_nsec
+		&& h.converted == lbr_options().convert_petscii
+		&& h.files <= (len - sizeof(h)) / sizeof(IndexRecord)
+		&& h.strings == len - sizeof(h) - h.files * sizeof(IndexRecord)
+		&& h.data_start <= key.size
+		&& directory_hash(fd, h.data_start, hash) && hash == h.key.hash;
+	if (ok) {
+		const char * strings = map + sizeof(h) + h.files * sizeof(IndexRecord);
+		auto str = [&](uint32_t at, uint32_t size, std::string & out) {
+			if ((uint64_t)at + size > h.strings) return false;
+			out.assign(strings + at, size);
+			return true;
+		};
+		index = LbrIndex();
+		index.count = h.count;
+		index.dir_start = h.dir_start;
+		index.data_start = h.data_start;
+		index.data_end = h.data_end;
+		index.truncated = h.truncated;
+		index.files.resize(h.files);
+		uint64_t max = lbr_options().max_length;
+		for (uint64_t i = 0; ok && i < h.files; ++i) {
+			IndexRecord r;
+			memcpy(&r, map + sizeof(h) + i * sizeof(r), sizeof(r));
+			FileEntry & f = index.files[i];
+			f.dir_offset = r.dir_offset;
+			f.dir_length = r.dir_length;
+			f.offset = r.offset;
+			f.length = r.length;
+			f.bad_length = !r.length_ok || (max && f.length > max);
+			index.bad_length = index.bad_length || f.bad_length;
+			ok = str(r.name, r.name_size, f.name) && str(r.ascii, r.ascii_size, f.ascii_name)
+				&& str(r.type, r.type_size, f.type);
+		}
+	}
+	munmap(p, len);
+	if (!ok) index = LbrIndex();
+	return ok;
+}
+
+// Best effort, an archive in a read-only place just goes without. dir is
+// the directory index was parsed from.
+static void save_index_cache(const std::string & path, const IndexKey & key, const LbrIndex & index,
+	std::string_view dir) {
+	IndexHeader h{};
+	memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+	h.key = key;
+	h.key.hash = directory_hash(dir.substr(0, index.data_start));
+	h.count = index.count;
+	h.dir_start = index.dir_start;
+	h.data_start = index.data_start;
+	h.data_end = index.data_end;
+	h.files = index.files.size();
+	h.truncated = index.truncated;
+	h.converted = lbr_options().convert_petscii;
+	std::string records(h.files * sizeof(IndexRecord), '\0');
+	std::string strings;
+	uint64_t max = lbr_options().max_length;
+	auto add = [&](const std::string & str, uint32_t & at, uint32_t & size) {
+		at = strings.size();
+		size = str.size();
+		strings += str;
+	};
+	for (uint64_t i = 0; i < h.files; ++i) {
+		const FileEntry & f = index.files[i];
+		IndexRecord r;
+		memset(&r, 0, sizeof(r));
+		r.dir_offset = f.dir_offset;
+		r.dir_length = f.dir_length;
+		r.offset = f.offset;
+		r.length = f.length;
+		// A length over the limit still parsed; only that case is kept.
+		r.length_ok = !f.bad_length || (max && f.length > max);
+		add(f.name, r.name, r.name_size);
+		add(f.ascii_name, r.ascii, r.ascii_size);
+		add(f.type, r.type, r.type_size);
+		memcpy(&records[i * sizeof(r)], &r, sizeof(r));
+	}
+	if (strings.size() > UINT32_MAX) return;
+	h.strings = strings.size();
+	std::string idx = path + ".idx";
+	std::string tmp_path;
+	int fd = open_sibling_temp(idx, tmp_path);
+	if (fd < 0) return;
+	if (!write_all(fd, reinterpret_cast<const char *>(&h), sizeof(h)) || !write_all(fd, records)
+		|| !write_all(fd, strings)) {
+		close(fd);
+		unlink(tmp_path.c_str());
+		return;
+	}
+	// A lost or torn index is only made again, it need not be durable.
+	commit_sibling_temp(fd, tmp_path, idx, -1, false);
+}
+
+// Reads the directory with pread and as few round trips as possible: one
+// block first, then, if the directory goes on past it, one more read sized
+// from the entry count and the average entry seen so far. Only an estimate
+// that falls short makes it read again. Readahead is turned off, so the
+// kernel does not pull in payload pages behind the directory either.
+int read_directory(const std::string & path, LbrIndex & index) {
+	PhaseTimer timer(LBR_PHASE_PARSE);
+	index = LbrIndex();
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return LBR_NOT_FOUND;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return LBR_READ_ERROR;
+	}
+	off_t size = st.st_size;
+	IndexKey key;
+	index_key(st, key);
+	if (lbr_options().index_cache && load_index_cache(path, fd, key, index)) {
+		close(fd);
+		return LBR_OK;
+	}
+#ifdef POSIX_FADV_RANDOM
+	posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+	std::string buf;
+	size_t want = std::min<off_t>(DIRECTORY_PREFETCH, std::max<off_t>(size, 0));
+	int res = LBR_OK;
+	for (;;) {
+		size_t old = buf.size();
+		buf.resize(want);
+		size_t got = old;
+		while (got < want) {
+			ssize_t n = pread(fd, &buf[got], want - got, got);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) break;
+			count_read(n);
+			got += n;
+		}
+		buf.resize(got);
+		if (!parse_directory(buf, index)) {
+			res = LBR_NOT_LBR;
+			break;
+		}
+		if (!index.truncated || got < want || (off_t)got >= size)
+			break;
+		// Entries seen so far tell how long the rest will be, with some
+		// headroom for longer names further down.
+		uint64_t parsed = index.files.size();
+		uint64_t seen = index.data_start - index.dir_start;
+		uint64_t estimate = got * 2;
+		if (parsed > 1)
+			estimate = std::max<uint64_t>(estimate / 2 + 4096,
+				index.dir_start + index.count * (seen / parsed) * 5 / 4 + 4096);
+		want = std::min<uint64_t>(estimate, size);
+	}
+	close(fd);
+	if (res == LBR_OK && lbr_options().index_cache && index.data_start <= buf.size())
+		save_index_cache(path, key, index, buf);
+	return res;
+}
+
+std::vector<std::string> find_archives(const std::vector<std::string> & roots) {
+	namespace fs = std::filesystem;
+	std::vector<std::string> found;
+	auto is_archive = [](const fs::path & p) {
+		std::string ext = p.extension();
+		std::transform(ext.begin(), ext.end(), ext.begin(),
+			[](auto c){ return std::tolower(c); });
+		return ext == ".lbr";
+	};
+	for (const auto & root : roots) {
+		std::error_code ec;
+		if (!fs::is_directory(root, ec)) {
+			found.push_back(root);
+			continue;
+		}
+		std::vector<std::string> here;
+		auto opts = fs::directory_options::skip_permission_denied;
+		for (fs::recursive_directory_iterator it(root, opts, ec), end; !ec && it != end; it.increment(ec)) {
+			if (it->is_regular_file(ec) && is_archive(it->path()))
+				here.push_back(it->path().string());
+		}
+		std::sort(here.begin(), here.end());
+		found.insert(found.end(), here.begin(), here.end());
+	}
+	return found;
+}
+
+void scan_directories(const std::vector<std::string> & paths,
+	const std::function<void(size_t, int, const LbrIndex &)> & done) {
+	int jobs = lbr_options().jobs;
+	if (jobs <= 1 || paths.size() <= 1) {
+		for (size_t i = 0; i < paths.size(); ++i) {
+			LbrIndex index;
+			int res = read_directory(paths[i], index);
+			done(i, res, index);
+		}
+		return;
+	}
+	// Results wait in a ring until every one before them is handed out, so
+	// a slow archive holds up at most window others.
+	struct Slot {
+		LbrIndex index;
+		int res = LBR_OK;
+		bool ready = false;
+	};
+	const size_t window = jobs * 16;
+	std::vector<Slot> ring(window);
+	std::mutex lock;
+	std::condition_variable slot_free, slot_ready;
+	size_t next = 0;
+	size_t handed = 0;
+	const LbrOptions & opts = lbr_options();
+	auto worker = [&]() {
+		LbrOptionsScope scope(opts);
+		for (;;) {
+			size_t k;
+			{
+				std::unique_lock<std::mutex> l(lock);
+				slot_free.wait(l, [&]() { return next >= paths.size() || next < handed + window; });
+				if (next >= paths.size()) return;
+				k = next++;
+			}
+			LbrIndex index;
+			int res = read_directory(paths[k], index);
+			std::lock_guard<std::mutex> l(lock);
+			Slot & slot = ring[k % window];
+			slot.index = std::move(index);
+			slot.res = res;
+			slot.ready = true;
+			slot_ready.notify_all();
+		}
+	};
+	std::vector<std::thread> workers;
+	for (int t = 0; t < jobs; ++t)
+		workers.emplace_back(worker);
+	for (size_t k = 0; k < paths.size(); ++k) {
+		Slot & slot = ring[k % window];
+		{
+			std::unique_lock<std::mutex> l(lock);
+			slot_ready.wait(l, [&]() { return slot.ready; });
+		}
+		done(k, slot.res, slot.index);
+		std::lock_guard<std::mutex> l(lock);
+		slot.index = LbrIndex();
+		slot.ready = false;
+		handed = k + 1;
+		slot_free.notify_all();
+	}
+	for (auto & t : workers)
+		t.join();
+}
+
+// Where one extracted entry goes. An empty path means standard output.
+struct ExtractOutput {
+	size_t entry;
+	std::filesystem::path path;
+	bool rest = false; // bad length, takes everything up to the end
+};
+
+// Works out which entries get extracted and where to, in archive order.
+// When two entries end up at the same path, only the later one is kept,
+// as if they had been written one after another.
+static std::vector<ExtractOutput> plan_extract(const LbrIndex & index, std::string dest_folder,
+	const std::vector<std::string> & targets, bool skip_deleted, bool add_extension, bool to_stdout) {
+	// Entries picked out by name, if any names were given.
+	std::vector<bool> selected;
+	if (!targets.empty()) {
+		LbrNameIndex names(index);
+		selected.resize(index.files.size());
+		for (const auto & t : targets) {
+			for (long i = names.first(t); i >= 0; i = names.next(i))
+				selected[i] = true;
+		}
+	}
+	std::vector<ExtractOutput> outputs;
+	std::unordered_map<std::string, size_t> by_path;
+	auto add_output = [&](size_t i, std::filesystem::path fp, bool rest) {
+		if (!to_stdout) {
+			auto res = by_path.emplace(fp.string(), outputs.size());
+			if (!res.second) {
+				outputs[res.first->second].path.clear();
+				res.first->second = outputs.size();
+			}
+		}
+		outputs.push_back({i, fp, rest});
+	};
+	for (size_t i = 0; i < index.files.size(); ++i) {
+		const FileEntry & f = index.files[i];
+		if (f.bad_length) {
+			// Just glob up everything
+			std::filesystem::path fp = dest_folder;
+			fp /= f.name;
+			if (!to_stdout || selected.empty() || selected[i])
+				add_output(i, to_stdout ? "" : fp, true);
+			break;
+		}
+		if (f.length == 0) continue;
+		if (f.type == "D" && skip_deleted)
+			continue;
+		if (!selected.empty() && !selected[i])
+			continue;
+		if (to_stdout) {
+			add_output(i, "", false);
+			continue;
+		}
+		std::filesystem::path fp = dest_folder;
+		std::string ascii_name = f.ascii_name;
+		if (add_extension) {
+			if (f.type == "P")
+				ascii_name += ".prg";
+			else if (f.type == "S")
+				ascii_name += ".seq";
+			else if (f.type == "U")
+				ascii_name += ".usr";
+			else if (f.type == "R")
+				ascii_name += ".rel";
+		}
+		fp /= ascii_name;
+		add_output(i, fp, false);
+	}
+	if (!to_stdout) {
+		outputs.erase(std::remove_if(outputs.begin(), outputs.end(),
+			[](const ExtractOutput & o) { return o.path.empty(); }), outputs.end());
+	}
+	return outputs;
+}
+
+// Extracts from an archive read in one forward pass from standard input.
+static int extract_stream(std::string dest_folder, std::vector<std::string> targets,
+	bool skip_deleted, bool add_extension, bool to_stdout) {
+	std::ostream & log = lbr_log();
+	LbrStream in(STDIN_FILENO);
+	LbrIndex index;
+	if (!in.read_directory(index)) {
+		log << "Error: invalid signature, not an LBR file?" << std::endl;
+		return LBR_NOT_LBR;
+	}
+	for (const auto & f : index.files) {
+		if (f.bad_length)
+			log << "Found file with bad length" << std::endl;
+	}
+	auto outputs = plan_extract(index, dest_folder, targets, skip_deleted, add_extension, to_stdout);
+	PhaseTimer timer(LBR_PHASE_COPY);
+	for (const auto & o : outputs) {
+		const FileEntry & f = index.files[o.entry];
+		if (!in.copy(f.offset - in.tell(), -1)) {
+			log << "Error reading from archive." << std::endl;
+			return LBR_READ_ERROR;
+		}
+		int out = STDOUT_FILENO;
+		if (!to_stdout) {
+			out = open(o.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (out < 0) {
+				log << "Error writing file: " << o.path.string() << std::endl;
+				return LBR_WRITE_ERROR;
+			}
+		}
+		bool ok = in.copy(o.rest ? -1 : (int64_t)f.length, out);
+		if (!to_stdout)
+			close(out);
+		if (!ok) {
+			log << "Error reading from archive." << std::endl;
+			return LBR_READ_ERROR;
+		}
+	}
+	return LBR_OK;
+}
+
+// Extracts entries from an opened archive. With to_stdout, the payloads
+// of the targets are written to standard output instead of files, one
+// after another in archive order.
+static int extract_view(const LbrArchiveView & view, std::string dest_folder, const std::vector<std::string> & targets,
+	bool skip_deleted, bool add_extension, bool to_stdout) {
+	std::ostream & log = lbr_log();
+	for (const auto & f : view.entries()) {
+		if (f.bad_length)
+			log << "Found file with bad length" << std::endl;
+	}
+	auto outputs = plan_extract(view.index(), dest_folder, targets, skip_deleted, add_extension, to_stdout);
+	PhaseTimer timer(LBR_PHASE_COPY);
+	auto data = [&](const ExtractOutput & o) {
+		const FileEntry & f = view.entries()[o.entry];
+		return o.rest ? view.remainder(f) : view.payload(f);
+	};
+	// Payloads go from the archive to their files without passing through
+	// the mapping; it only tells how much of each is there.
+	if (to_stdout) {
+		for (const auto & o : outputs) {
+			off_t offset = view.entries()[o.entry].offset;
+			if (!copy_range(view.fd(), offset, STDOUT_FILENO, data(o).size())) {
+				log << "Error writing to standard output." << std::endl;
+				return LBR_WRITE_ERROR;
+			}
+		}
+		return LBR_OK;
+	}
+
+	std::vector<char> failed(outputs.size());
+#ifdef LBR_IO_URING
+	// Batches of files are opened, written out of the mapping and closed
+	// with one submission each. Payloads too big for that are copied in
+	// the kernel between the opens and the closes.
+	IoRing uring;
+	if (outputs.size() > 1 && uring.init(URING_DEPTH)) {
+		std::vector<int> fds(URING_DEPTH), done(URING_DEPTH);
+		for (size_t first = 0; first < outputs.size(); first += URING_DEPTH) {
+			size_t count = std::min<size_t>(URING_DEPTH, outputs.size() - first);
+			std::fill(fds.begin(), fds.end(), -1);
+			std::fill(done.begin(), done.end(), -1);
+			for (size_t i = 0; i < count; ++i)
+				uring.openat(outputs[first + i].path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666, i);
+			bool ok = uring.run([&](uint64_t i, int res) { fds[i] = res; });
+			for (size_t i = 0; ok && i < count; ++i) {
+				std::string_view d = data(outputs[first + i]);
+				if (fds[i] >= 0 && d.size() <= BufferPool::CHUNK_SIZE)
+					uring.write(fds[i], d.data(), d.size(), 0, i);
+			}
+			ok = ok && uring.run([&](uint64_t i, int res) { done[i] = res; });
+			for (size_t i = 0; i < count; ++i) {
+				const ExtractOutput & o = outputs[first + i];
+				std::string_view d = data(o);
+				failed[first + i] = !ok || fds[i] < 0;
+				if (failed[first + i]) continue;
+				if (d.size() > BufferPool::CHUNK_SIZE)
+					failed[first + i] = !copy_range(view.fd(), view.entries()[o.entry].offset, fds[i], d.size());
+				else if (done[i] < 0)
+					failed[first + i] = true;
+				else {
+					count_write(done[i]);
+					failed[first + i] = !pwrite_all(fds[i], d.data() + done[i], d.size() - done[i], done[i]);
+				}
+			}
+			for (size_t i = 0; i < count; ++i) {
+				if (fds[i] >= 0 && (!ok || !uring.close(fds[i], i))) close(fds[i]);
+			}
+			uring.run([&](uint64_t i, int res) { if (res < 0) failed[first + i] = true; });
+		}
+	} else
+#endif
+	parallel_for(lbr_options().jobs, outputs.size(), [&](size_t i) {
+		const ExtractOutput & o = outputs[i];
+		failed[i] = !write_file(o.path, view.fd(), view.entries()[o.entry].offset, data(o).size());
+	});
+	int res = LBR_OK;
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		if (failed[i]) {
+			log << "Error writing file: " << outputs[i].path.string() << std::endl;
+			res = LBR_WRITE_ERROR;
+		}
+	}
+	return res;
+}
+
+// Extracts entries from the archive infile, "-" for standard input.
+int extract_lbr(std::string infile, std::string dest_folder, std::vector<std::string> targets,
+	bool skip_deleted, bool add_extension, bool to_stdout) {
+	if (infile == "-")
+		return extract_stream(dest_folder, targets, skip_deleted, add_extension, to_stdout);
+	LbrArchiveView view;
+	if (!view.open(infile)) {
+		lbr_log() << "Error: invalid signature, not an LBR file?" << std::endl;
+		return LBR_NOT_LBR;
+	}
+	return extract_view(view, dest_folder, targets, skip_deleted, add_extension, to_stdout);
+}
+
+// Returns the first entry called target, or nullptr if there is none or the
+// directory has a bad length in it. Callers looking up many names in the
+// same index pass names, the others nullptr for a scan of the directory.
+static const FileEntry * find_in_lbr(const LbrIndex & index, const LbrNameIndex * names, std::string target, bool skip_deleted) {
+	if (index.bad_length) {
+		lbr_log() << "Found file with bad length" << std::endl;
+		return nullptr;
+	}
+	auto usable = [&](const FileEntry & f) { return f.type[0] != 'D' || !skip_deleted; };
+	if (names) {
+		for (long i = names->first(target); i >= 0; i = names->next(i)) {
+			if (usable(index.files[i]))
+				return &index.files[i];
+		}
+		return nullptr;
+	}
+	for (const auto & f : index.files) {
+		if (f.ascii_name == target && usable(f))
+			return &f;
+	}
+	return nullptr;
+}
+
+// Looks target up in the directory of file, which is all that is read of
+// it, and opens file for reading that one payload. available is how much
+// of the payload the file holds.
+static int open_entry(const std::string & file, const std::string & target, bool skip_deleted,
+	FileEntry & entry, int & fd, uint64_t & available) {
+	LbrIndex index;
+	int res = read_directory(file, index);
+	if (res == LBR_NOT_FOUND) {
+		lbr_log() << "File not found: " << file << std::endl;
+		return res;
+	}
+	if (res != LBR_OK) {
+		lbr_log() << "Error: invalid signature, not an LBR file?" << std::endl;
+		return res;
+	}
+	const FileEntry * f = find_in_lbr(index, nullptr, target, skip_deleted);
+	if (!f) {
+		if (!index.bad_length)
+			lbr_log() << "Entry not found: " << target << std::endl;
+		return index.bad_length ? LBR_BAD_LENGTH : LBR_NOT_FOUND;
+	}
+	fd = open(file.c_str(), O_RDONLY);
+	off_t size = fd < 0 ? -1 : fd_size(fd);
+	if (size < 0) {
+		if (fd >= 0) close(fd);
+		lbr_log() << "Error reading file: " << file << std::endl;
+		return LBR_READ_ERROR;
+	}
+	entry = *f;
+	available = (uint64_t)size > f->offset ? std::min<uint64_t>(f->length, size - f->offset) : 0;
+	return LBR_OK;
+}
+
+int read_entry(std::string file, std::string target, std::string & data, bool skip_deleted) {
+	FileEntry f;
+	int fd;
+	uint64_t available;
+	data.clear();
+	int res = open_entry(file, target, skip_deleted, f, fd, available);
+	if (res != LBR_OK) return res;
+	PhaseTimer timer(LBR_PHASE_COPY);
+	data.resize(available);
+	size_t got = 0;
+	while (got < available) {
+		ssize_t n = pread(fd, &data[got], available - got, f.offset + got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		count_read(n);
+		got += n;
+	}
+	close(fd);
+	data.resize(got);
+	if (got < f.length) {
+		lbr_log() << "Error reading file: " << file << std::endl;
+		return LBR_READ_ERROR;
+	}
+	return LBR_OK;
+}
+
+int cat_lbr(std::string file, std::string target, bool skip_deleted) {
+	FileEntry f;
+	int fd;
+	uint64_t available;
+	int res = open_entry(file, target, skip_deleted, f, fd, available);
+	if (res != LBR_OK) return res;
+	PhaseTimer timer(LBR_PHASE_COPY);
+	bool ok = copy_range(fd, f.offset, STDOUT_FILENO, available);
+	close(fd);
+	if (!ok) {
+		lbr_log() << "Error writing to standard output." << std::endl;
+		return LBR_WRITE_ERROR;
+	}
+	if (available < f.length) {
+		lbr_log() << "Error reading file: " << file << std::endl;
+		return LBR_READ_ERROR;
+	}
+	return LBR_OK;
+}
+
+// CRC32C (Castagnoli), reflected, as in iSCSI and ext4.
+static const uint32_t CRC32C_POLY = 0x82F63B78;
+
+// Software CRC32C, eight bytes per step from eight tables.
+static uint32_t crc32c_sw(uint32_t crc, const char * p, size_t len) {
+	static const std::vector<std::array<uint32_t, 256>> table = []() {
+		std::vector<std::array<uint32_t, 256>> t(8);
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+			t[0][i] = c;
+		}
+		for (uint32_t i = 0; i < 256; ++i) {
+			for (int k = 1; k < 8; ++k)
+				t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+		}
+		return t;
+	}();
+	const unsigned char * b = reinterpret_cast<const unsigned char *>(p);
+	for (; len >= 8; b += 8, len -= 8) {
+		uint32_t lo = crc ^ (b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24);
+		crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24]
+			^ table[3][b[4]] ^ table[2][b[5]] ^ table[1][b[6]] ^ table[0][b[7]];
+	}
+	for (; len > 0; ++b, --len)
+		crc = (crc >> 8) ^ table[0][(crc ^ *b) & 0xFF];
+	return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+// With the SSE4.2 crc32 instruction, picked at run time.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const char * p, size_t len) {
+	uint64_t c = crc;
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	crc = c;
+	for (; len > 0; ++p, --len)
+		crc = __builtin_ia32_crc32qi(crc, *p);
+	return crc;
+}
+#endif
+
+static uint32_t crc32c(std::string_view data) {
+	uint32_t crc = ~0u;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	static const bool hw = __builtin_cpu_supports("sse4.2");
+	if (hw)
+		return ~crc32c_hw(crc, data.data(), data.size());
+#endif
+	return ~crc32c_sw(crc, data.data(), data.size());
+}
+
+// Checks the archive at file against its own directory in one pass over
+// the directory, and with a checksum asked for, sums every payload on up
+// to LbrOptions::jobs threads straight out of a mapping of the file.
+int verify_lbr(std::string file, LbrChecksum sum, LbrVerifyResult & result) {
+	result = LbrVerifyResult();
+	LbrArchiveView view;
+	if (!view.open(file)) {
+		bool exists = access(file.c_str(), F_OK) == 0;
+		result.problems.push_back(exists ? "invalid signature, not an LBR file" : "file not found");
+		return exists ? LBR_NOT_LBR : LBR_NOT_FOUND;
+	}
+	const LbrIndex & index = view.index();
+	std::string_view data = view.data();
+	uint64_t size = data.size();
+	int res = LBR_OK;
+	auto problem = [&](int status, std::string what) {
+		result.problems.push_back(what);
+		if (res == LBR_OK) res = status;
+	};
+	// Past the first bad length no payload offset means anything, so only
+	// the directory entries are checked from there on.
+	size_t placed = index.files.size();
+	{
+		PhaseTimer timer(LBR_PHASE_PARSE);
+		std::string header = "DWB " + std::to_string(index.count) + " \x0D";
+		if (data.substr(0, index.dir_start) != header)
+			problem(LBR_CORRUPT, "malformed header");
+		if (index.files.size() < index.count)
+			problem(LBR_CORRUPT, "directory ends after " + std::to_string(index.files.size())
+				+ " of " + std::to_string(index.count) + " entries");
+		for (size_t i = 0; i < index.files.size(); ++i) {
+			const FileEntry & f = index.files[i];
+			if (f.bad_length) {
+				problem(LBR_BAD_LENGTH, "bad length: " + f.ascii_name);
+				placed = std::min(placed, i);
+				continue;
+			}
+			std::string entry = f.name + "\x0D" + f.type + "\x0D " + std::to_string(f.length) + " \x0D";
+			if (f.dir_length != entry.size() || data.substr(f.dir_offset, f.dir_length) != entry)
+				problem(LBR_CORRUPT, "malformed directory entry: " + f.ascii_name);
+			else if (i < placed && f.length > 0 && f.offset + f.length > size)
+				problem(LBR_CORRUPT, "payload cut short: " + f.ascii_name + ", "
+					+ std::to_string(f.offset < size ? size - f.offset : 0) + " of " + std::to_string(f.length) + " bytes");
+		}
+		if (!index.bad_length && !index.truncated && index.data_end < size)
+			problem(LBR_CORRUPT, std::to_string(size - index.data_end) + " bytes past the last payload");
+	}
+	result.index = index;
+	if (sum != LbrChecksum::None) {
+		PhaseTimer timer(LBR_PHASE_HASH);
+		result.checksums.resize(placed);
+		parallel_for(lbr_options().jobs, placed, [&](size_t i) {
+			std::string_view d = view.payload(index.files[i]);
+			if (sum == LbrChecksum::Crc32c)
+				result.checksums[i] = crc32c(d);
+			else {
+				Xxh64 h;
+				h.update(d.data(), d.size());
+				result.checksums[i] = h.digest();
+			}
+		});
+	}
+	return res;
+}
+
+// Reads a batch script: one step per line, as "delete NAME", "wipe NAME",
+// "type NAME:TYPE", "append PATH", "replace NAME:PATH" or "compact [padding]".
+// Empty lines and lines starting with '#' are skipped.
+int read_batch_script(std::string script, std::vector<BatchStep> & steps) {
+	std::ifstream in(script);
+	if (!in) {
+		lbr_log() << "File not found: " << script << std::endl;
+		return LBR_NOT_FOUND;
+	}
+	std::string line;
+	int lineno = 0;
+	while (std::getline(in, line)) {
+		++lineno;
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty() || line[0] == '#')
+			continue;
+		size_t sp = line.find(' ');
+		std::string cmd = line.substr(0, sp);
+		std::string arg = sp == std::string::npos ? "" : line.substr(sp + 1);
+		BatchStep step;
+		if (cmd == "delete")
+			step.op = BatchOp::Delete;
+		else if (cmd == "wipe")
+			step.op = BatchOp::Wipe;
+		else if (cmd == "type") {
+			step.op = BatchOp::ChangeType;
+			size_t cln = arg.find_last_of(":");
+			if (cln == std::string::npos) {
+				lbr_log() << script << ":" << lineno << ": Missing separator in argument." << std::endl;
+				return LBR_INVALID;
+			}
+			step.type = arg.substr(cln+1);
+			arg = arg.substr(0, cln);
+		} else if (cmd == "append")
+			step.op = BatchOp::Append;
+		else if (cmd == "replace") {
+			// CBM names can not hold a colon, paths can.
+			step.op = BatchOp::Replace;
+			size_t cln = arg.find(':');
+			if (cln == std::string::npos) {
+				lbr_log() << script << ":" << lineno << ": Missing separator in argument." << std::endl;
+				return LBR_INVALID;
+			}
+			step.path = arg.substr(cln + 1);
+			arg = arg.substr(0, cln);
+			if (!std::filesystem::exists(step.path)) {
+				lbr_log() << "File not found: " << step.path << std::endl;
+				return LBR_NOT_FOUND;
+			}
+		}
+		else if (cmd == "compact") {
+			step.op = BatchOp::Compact;
+			if (!arg.empty() && arg != "padding") {
+				lbr_log() << script << ":" << lineno << ": Unknown argument: " << arg << std::endl;
+				return LBR_INVALID;
+			}
+			step.type = arg;
+			steps.push_back(step);
+			continue;
+		}
+		else {
+			lbr_log() << script << ":" << lineno << ": Unknown command: " << cmd << std::endl;
+			return LBR_INVALID;
+		}
+		if (arg.empty()) {
+			lbr_log() << script << ":" << lineno << ": Missing argument." << std::endl;
+			return LBR_INVALID;
+		}
+		if (step.op == BatchOp::Append && !std::filesystem::exists(arg)) {
+			lbr_log() << "File not found: " << arg << std::endl;
+			return LBR_NOT_FOUND;
+		}
+		step.target = arg;
+		steps.push_back(step);
+	}
+	return LBR_OK;
+}
+
+// An entry of the archive being planned by batch_lbr.
+struct PlannedEntry {
+	const FileEntry * src = nullptr; // entry of the old archive, if any
+	std::string type; // petscii, when changed
+	bool type_changed = false;
+	bool deleted = false; // payload dropped, length 0
+	bool wiped = false; // dropped from the archive
+	std::string ascii_name; // appended files only
+	std::string entry; // appended files only, full directory entry
+	std::string path; // appended or replacing file
+	uint64_t length = 0;
+	bool replaced = false; // payload is the file at path now
+};
+
+// Applies all steps, in order, to the directory of the archive and writes
+// the result out in a single rewrite. Steps see the effect of the ones
+// before them, as if they were run one at a time. Nothing is written if
+// any step fails. view is the archive file already opened, closed again
+// once it is no longer needed, and names an index of it or nullptr.
+static int batch_view(const std::string & file, LbrArchiveView & view, const LbrNameIndex * names,
+	const std::vector<BatchStep> & steps, bool skip_deleted, bool strip_extension) {
+	const LbrIndex & index = view.index();
+	auto fail = [&](const BatchStep & step) {
+		if (steps.size() > 1 && !index.bad_length)
+			lbr_log() << "Entry not found: " << step.target << std::endl;
+		if (step.op == BatchOp::ChangeType || step.op == BatchOp::Replace)
+			lbr_log() << "Failed" << std::endl;
+		else if (step.op != BatchOp::Append)
+			lbr_log() << "No deletion occured." << std::endl;
+		return index.bad_length ? LBR_BAD_LENGTH : LBR_NOT_FOUND;
+	};
+	if (index.bad_length) {
+		lbr_log() << "Found file with bad length" << std::endl;
+		return fail(steps.front());
+	}
+
+	std::vector<PlannedEntry> plan(index.files.size());
+	for (size_t i = 0; i < plan.size(); ++i)
+		plan[i].src = &index.files[i];
+	std::unique_ptr<LbrNameIndex> own_names;
+	if (!names) {
+		own_names.reset(new LbrNameIndex(index));
+		names = own_names.get();
+	}
+	// Appended entries come after all old ones, so they are searched last.
+	std::unordered_map<std::string, std::vector<size_t>> appended;
+	auto lookup = [&](const std::string & target) -> PlannedEntry * {
+		auto usable = [&](PlannedEntry & p) {
+			if (p.wiped) return false;
+			std::string type = p.type_changed ? p.type : p.src ? p.src->type : "";
+			return type[0] != 'D' || !skip_deleted;
+		};
+		for (long i = names->first(target); i >= 0; i = names->next(i)) {
+			if (usable(plan[i])) return &plan[i];
+		}
+		auto it = appended.find(target);
+		if (it != appended.end()) {
+			for (size_t i : it->second) {
+				if (usable(plan[i])) return &plan[i];
+			}
+		}
+		return nullptr;
+	};
+
+	uint64_t count = index.count;
+	for (const auto & step : steps) {
+		if (step.op == BatchOp::Append) {
+			PlannedEntry p;
+			p.path = step.target;
+			std::error_code ec;
+			p.length = std::filesystem::file_size(step.target, ec);
+			if (ec) {
+				lbr_log() << "File not found: " << step.target << std::endl;
+				return LBR_NOT_FOUND;
+			}
+			std::string name = std::filesystem::path(step.target).filename();
+			if (lbr_options().verbose)
+				lbr_log() << "+ " << name;
+			p.entry = make_dir_entry(name, p.length, strip_extension);
+			p.ascii_name = petscii2ascii(p.entry.substr(0, p.entry.find(0x0D)));
+			appended[p.ascii_name].push_back(plan.size());
+			plan.push_back(p);
+			++count;
+			continue;
+		}
+		if (step.op == BatchOp::Compact) {
+			bool keep_padding = step.type == "padding";
+			for (auto & p : plan) {
+				if (p.wiped) continue;
+				std::string type = p.type_changed ? p.type : p.src ? p.src->type : p.length ? "" : "D";
+				if (type != "D") continue;
+				// Slots --pad-sorted made: deleted, empty and named by number.
+				const std::string & name = p.src ? p.src->ascii_name : p.ascii_name;
+				uint64_t length = p.deleted ? 0 : p.src && !p.replaced ? p.src->length : p.length;
+				if (keep_padding && length == 0 && !name.empty()
+					&& name.find_first_not_of("0123456789") == std::string::npos)
+					continue;
+				p.wiped = true;
+				--count;
+			}
+			continue;
+		}
+		PlannedEntry * p = step.entry < 0 ? lookup(step.target)
+			: (size_t)step.entry < index.files.size() && !plan[step.entry].wiped ? &plan[step.entry] : nullptr;
+		if (!p)
+			return fail(step);
+		if (step.op == BatchOp::Delete) {
+			p->deleted = true;
+			p->type_changed = true;
+			p->type = "D";
+		} else if (step.op == BatchOp::Wipe) {
+			p->wiped = true;
+			--count;
+		} else if (step.op == BatchOp::Replace) {
+			std::error_code ec;
+			uint64_t length = std::filesystem::file_size(step.path, ec);
+			if (ec) {
+				lbr_log() << "File not found: " << step.path << std::endl;
+				return LBR_NOT_FOUND;
+			}
+			std::string entry = make_dir_entry(std::filesystem::path(step.path).filename(), length, false);
+			size_t type_start = entry.find(0x0D) + 1;
+			p->type_changed = true;
+			p->type = entry.substr(type_start, entry.find(0x0D, type_start) - type_start);
+			p->deleted = false;
+			p->path = step.path;
+			p->length = length;
+			p->replaced = true;
+			if (!p->src) p->entry = p->entry.substr(0, p->entry.find(0x0D) + 1) + entry.substr(type_start);
+		} else {
+			p->type_changed = true;
+			p->type = ascii2petscii(step.type);
+		}
+	}
+
+	if (lbr_options().dedup != LbrDedup::Off) {
+		// Appended files against each other and against the entries that
+		// stay, which come first.
+		std::vector<DedupSource> sources;
+		std::vector<PlannedEntry *> planned;
+		size_t first_appended = 0;
+		uint64_t size = view.data().size();
+		for (int appended_pass = 0; appended_pass < 2; ++appended_pass) {
+			if (appended_pass) first_appended = sources.size();
+			for (auto & p : plan) {
+				if (p.wiped || p.deleted || bool(p.src) == bool(appended_pass)) continue;
+				DedupSource s;
+				s.path = p.path;
+				s.fd = view.fd();
+				if (p.src && !p.replaced) {
+					s.offset = p.src->offset;
+					s.length = p.src->offset < size ? std::min(p.src->length, size - p.src->offset) : 0;
+				} else
+					s.length = p.length;
+				sources.push_back(s);
+				planned.push_back(&p);
+			}
+		}
+		std::vector<long> same = find_duplicates(sources, first_appended);
+		for (size_t i = first_appended; i < sources.size(); ++i) {
+			if (same[i] < 0) continue;
+			const PlannedEntry & first = *planned[same[i]];
+			report_duplicate(planned[i]->path, first.src ? first.src->ascii_name : first.path);
+			if (lbr_options().dedup == LbrDedup::Skip) {
+				planned[i]->wiped = true;
+				--count;
+			}
+		}
+	}
+
+	std::vector<Segment> segs;
+	if (count == index.count)
+		add_range(segs, 0, index.dir_start);
+	else
+		add_literal(segs, "DWB " + std::to_string(count) + " \x0D");
+	for (auto & p : plan) {
+		if (p.wiped) continue;
+		if (!p.src) {
+			add_literal(segs, p.entry);
+			continue;
+		}
+		const FileEntry & f = *p.src;
+		if (!p.type_changed && !p.deleted) {
+			add_range(segs, f.dir_offset, f.dir_length);
+			continue;
+		}
+		uint64_t name_end = f.dir_offset + f.name.size();
+		uint64_t type_end = name_end + 1 + f.type.size();
+		add_range(segs, f.dir_offset, name_end + 1 - f.dir_offset); // name
+		add_literal(segs, p.type + "\x0D");
+		if (p.deleted)
+			add_literal(segs, " 0 \x0D");
+		else if (p.replaced)
+			add_literal(segs, " " + std::to_string(p.length) + " \x0D");
+		else
+			add_range(segs, type_end + 1, f.dir_offset + f.dir_length - (type_end + 1));
+	}
+	off_t size = view.data().size();
+	for (auto & p : plan) {
+		if (!p.src || p.wiped || p.deleted) continue;
+		if (p.replaced)
+			add_range(segs, 0, p.length, p.path);
+		else // payloads of a truncated archive are cut short
+			add_range(segs, p.src->offset, std::min<off_t>(p.src->length, size - p.src->offset));
+	}
+	for (auto & p : plan) {
+		if (p.src || p.wiped) continue;
+		add_range(segs, 0, p.length, p.path);
+	}
+	add_range(segs, index.data_end, size - index.data_end);
+	view.close();
+	return rewrite_lbr(file, segs);
+}
+
+int batch_lbr(std::string file, const std::vector<BatchStep> & steps, bool skip_deleted, bool strip_extension) {
+	LbrArchiveView view;
+	if (!view.open(file)) {
+		lbr_log() << "Error: invalid signature, not an LBR file?" << std::endl;
+		return LBR_NOT_LBR;
+	}
+	return batch_view(file, view, nullptr, steps, skip_deleted, strip_extension);
+}
+
+int delete_lbr(std::string file, std::string target, bool skip_deleted, bool wipe) {
+	BatchStep step;
+	step.op = wipe ? BatchOp::Wipe : BatchOp::Delete;
+	step.target = target;
+	return batch_lbr(file, {step}, skip_deleted, false);
+}
+
+int chtype_lbr(std::string file, std::string target, std::string new_type, bool skip_deleted) {
+	// A type of the same length becomes a single write over the old one.
+	BatchStep step;
+	step.op = BatchOp::ChangeType;
+	step.target = target;
+	step.type = new_type;
+	return batch_lbr(file, {step}, skip_deleted, false);
+}
+
+int add_lbr(std::string file, std::vector<std::string> targets, bool strip_extension) {
+	std::vector<BatchStep> steps;
+	for (const auto & a : targets) {
+		BatchStep step;
+		step.op = BatchOp::Append;
+		step.target = a;
+		steps.push_back(step);
+	}
+	return batch_lbr(file, steps, false, strip_extension);
+}
+
+int sync_lbr(std::string file, std::string dir, bool compare_contents, bool strip_extension) {
+	std::ostream & log = lbr_log();
+	// What building from dir would give, in file name order.
+	struct Wanted {
+		std::string path;
+		std::string name; // petscii
+		std::string type;
+		uint64_t length = 0;
+		bool matched = false;
+	};
+	std::vector<Wanted> wanted;
+	// The archive and its index may be in dir themselves, and are no
+	// files of it.
+	std::vector<std::pair<dev_t, ino_t>> own;
+	for (const std::string & path : {file, file + ".idx"}) {
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0)
+			own.emplace_back(st.st_dev, st.st_ino);
+	}
+	std::error_code ec;
+	for (const auto & e : std::filesystem::directory_iterator(dir, ec)) {
+		std::error_code fec;
+		if (!e.is_regular_file(fec)) continue;
+		struct stat st;
+		if (stat(e.path().c_str(), &st) == 0
+			&& std::find(own.begin(), own.end(), std::make_pair(st.st_dev, st.st_ino)) != own.end())
+			continue;
+		Wanted w;
+		w.path = e.path();
+		w.length = e.file_size(fec);
+		if (fec) continue;
+		wanted.push_back(w);
+	}
+	if (ec) {
+		log << "File not found: " << dir << std::endl;
+		return LBR_NOT_FOUND;
+	}
+	std::sort(wanted.begin(), wanted.end(), [](const Wanted & a, const Wanted & b) { return a.path < b.path; });
+	std::unordered_map<std::string, std::vector<size_t>> by_name;
+	for (size_t i = 0; i < wanted.size(); ++i) {
+		Wanted & w = wanted[i];
+		std::string entry = make_dir_entry(std::filesystem::path(w.path).filename(), w.length, strip_extension);
+		size_t cr = entry.find(0x0D);
+		w.name = entry.substr(0, cr);
+		w.type = entry.substr(cr + 1, entry.find(0x0D, cr + 1) - cr - 1);
+		by_name[w.name].push_back(i);
+	}
+
+	LbrArchiveView view;
+	if (!view.open(file)) {
+		log << "Error: invalid signature, not an LBR file?" << std::endl;
+		return LBR_NOT_LBR;
+	}
+	const LbrIndex & index = view.index();
+	if (index.bad_length) {
+		log << "Found file with bad length" << std::endl;
+		return LBR_BAD_LENGTH;
+	}
+	// Each entry takes the first file of its name not taken yet.
+	std::vector<long> match(index.files.size(), -1);
+	for (size_t i = 0; i < index.files.size(); ++i) {
+		auto it = by_name.find(index.files[i].name);
+		if (it == by_name.end()) continue;
+		for (size_t w : it->second) {
+			if (wanted[w].matched) continue;
+			wanted[w].matched = true;
+			match[i] = w;
+			break;
+		}
+	}
+	std::vector<char> differs(index.files.size());
+	std::vector<size_t> to_compare;
+	for (size_t i = 0; i < index.files.size(); ++i) {
+		if (match[i] < 0) continue;
+		const FileEntry & f = index.files[i];
+		const Wanted & w = wanted[match[i]];
+		differs[i] = f.type != w.type || f.length != w.length || view.payload(f).size() != f.length;
+		if (!differs[i] && compare_contents && f.length > 0)
+			to_compare.push_back(i);
+	}
+	if (!to_compare.empty()) {
+		PhaseTimer timer(LBR_PHASE_HASH);
+		parallel_for(lbr_options().jobs, to_compare.size(), [&](size_t k) {
+			size_t i = to_compare[k];
+			std::string_view payload = view.payload(index.files[i]);
+			BufferPool::Chunk chunk = buffer_pool().acquire();
+			DedupSource s;
+			s.path = wanted[match[i]].path;
+			s.length = payload.size();
+			size_t pos = 0;
+			differs[i] = !chunk || !read_source(s, chunk, [&](const char * p, size_t n) {
+				bool same = memcmp(p, payload.data() + pos, n) == 0;
+				pos += n;
+				return same;
+			});
+		});
+	}
+
+	std::vector<BatchStep> steps;
+	size_t replaced = 0, wiped = 0, appended = 0;
+	for (size_t i = 0; i < index.files.size(); ++i) {
+		const FileEntry & f = index.files[i];
+		BatchStep step;
+		step.entry = i;
+		step.target = f.ascii_name;
+		if (match[i] >= 0 && differs[i]) {
+			step.op = BatchOp::Replace;
+			step.path = wanted[match[i]].path;
+			++replaced;
+		} else if (match[i] < 0 && !(f.type == "D" && f.length == 0)) {
+			step.op = BatchOp::Wipe;
+			++wiped;
+		} else
+			continue;
+		steps.push_back(step);
+	}
+	for (const auto & w : wanted) {
+		if (w.matched) continue;
+		BatchStep step;
+		step.op = BatchOp::Append;
+		step.target = w.path;
+		steps.push_back(step);
+		++appended;
+	}
+	if (lbr_options().verbose)
+		log << file << ": " << appended << " appended, " << replaced << " replaced, "
+			<< wiped << " wiped" << std::endl;
+	if (steps.empty())
+		return LBR_OK;
+	return batch_view(file, view, nullptr, steps, false, strip_extension);
+}
+
+LbrArchive::LbrArchive(const LbrOptions & opts) : opts(opts) {}
+
+LbrArchive::~LbrArchive() = default;
+
+int LbrArchive::open(const std::string & path) {
+	LbrOptionsScope scope(opts);
+	close();
+	file = path;
+	view.reset(new LbrArchiveView());
+	if (!view->open(path)) {
+		view.reset();
+		lbr_log() << "Error: invalid signature, not an LBR file?" << std::endl;
+		return LBR_NOT_LBR;
+	}
+	names.reset(new LbrNameIndex(view->index()));
+	return LBR_OK;
+}
+
+void LbrArchive::close() {
+	names.reset();
+	view.reset();
+}
+
+bool LbrArchive::is_open() const {
+	return view != nullptr;
+}
+
+const LbrIndex & LbrArchive::index() const {
+	static const LbrIndex empty;
+	return view ? view->index() : empty;
+}
+
+const std::vector<FileEntry> & LbrArchive::list() const {
+	return index().files;
+}
+
+const FileEntry * LbrArchive::find(const std::string & name, bool skip_deleted) const {
+	if (!view) return nullptr;
+	LbrOptionsScope scope(opts);
+	return find_in_lbr(view->index(), names.get(), name, skip_deleted);
+}
+
+int LbrArchive::read(const FileEntry & f, std::string_view & data) const {
+	if (!view) return LBR_INVALID;
+	if (f.bad_length) return LBR_BAD_LENGTH;
+	data = view->payload(f);
+	return data.size() == f.length ? LBR_OK : LBR_READ_ERROR;
+}
+
+int LbrArchive::read(const std::string & name, std::string & data, bool skip_deleted) const {
+	const FileEntry * f = find(name, skip_deleted);
+	if (!f) return index().bad_length ? LBR_BAD_LENGTH : LBR_NOT_FOUND;
+	std::string_view d;
+	int res = read(*f, d);
+	data.assign(d.data(), d.size());
+	return res;
+}
+
+int LbrArchive::extract(const std::string & dest_folder, const std::vector<std::string> & targets,
+	bool skip_deleted, bool add_extension) {
+	if (!view) return LBR_INVALID;
+	LbrOptionsScope scope(opts);
+	return extract_view(*view, dest_folder, targets, skip_deleted, add_extension, false);
+}
+
+int LbrArchive::apply(const std::vector<BatchStep> & steps, bool skip_deleted, bool strip_extension, bool reopen) {
+	if (!view) return LBR_INVALID;
+	if (steps.empty()) return LBR_OK;
+	LbrOptionsScope scope(opts);
+	// batch_view lets go of the mapping before the file is replaced.
+	int res = batch_view(file, *view, names.get(), steps, skip_deleted, strip_extension);
+	close();
+	if (!reopen) return res;
+	int reopened = open(file);
+	return res != LBR_OK ? res : reopened;
+}
+
+int LbrArchive::remove(const std::string & name, bool skip_deleted) {
+	return apply({{BatchOp::Delete, name, ""}}, skip_deleted);
+}
+
+int LbrArchive::wipe(const std::string & name, bool skip_deleted) {
+	return apply({{BatchOp::Wipe, name, ""}}, skip_deleted);
+}
+
+int LbrArchive::set_type(const std::string & name, const std::string & type, bool skip_deleted) {
+	return apply({{BatchOp::ChangeType, name, type}}, skip_deleted);
+}
+
+int LbrArchive::compact(bool keep_padding) {
+	return apply({{BatchOp::Compact, "", keep_padding ? "padding" : ""}});
+}
+
+int LbrArchive::append(const std::vector<std::string> & paths, bool strip_extension) {
+	std::vector<BatchStep> steps;
+	for (const auto & a : paths)
+		steps.push_back({BatchOp::Append, a, ""});
+	return apply(steps, false, strip_extension);
+}
@@ -0,0 +1,329 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// liblbr: reading, writing and editing LBR archives in process. The lbr
+// tool is a thin command line around this.
+//
+// Everything runs with the LbrOptions of the calling thread, set with an
+// LbrOptionsScope; LbrArchive sets its own around every call. Functions
+// return an LbrStatus. Messages only go to LbrOptions::log, which is
+// unset by default.
+
+#ifndef LBR_LIBLBR_H
+#define LBR_LIBLBR_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <ostream>
+#include <atomic>
+#include <cstdint>
+#include <sys/types.h>
+
+// What time and I/O went into, for LbrOptions::stats.
+enum LbrPhase {
+	LBR_PHASE_PARSE, // reading and scanning directories
+	LBR_PHASE_CONVERT, // converting names between PETSCII and ASCII
+	LBR_PHASE_COPY, // copying payloads out of or into archives
+	LBR_PHASE_REWRITE, // writing edited archives
+	LBR_PHASE_SYNC, // flushing archives to disk before they replace the old ones
+	LBR_PHASE_HASH, // hashing and comparing payloads
+	LBR_PHASE_OTHER, // I/O outside of all of the above, never timed
+	LBR_PHASE_COUNT
+};
+
+const char * lbr_phase_name(int phase);
+
+// Wall time and read / write calls of one phase. Time nested in another
+// phase only counts for the inner one. In-kernel copies count as one read
+// and one write call each; payloads read out of a mapping are not counted.
+struct LbrPhaseStats {
+	std::atomic<uint64_t> nanoseconds{0};
+	std::atomic<uint64_t> bytes_read{0};
+	std::atomic<uint64_t> bytes_written{0};
+	std::atomic<uint64_t> reads{0};
+	std::atomic<uint64_t> writes{0};
+};
+
+struct LbrStats {
+	LbrPhaseStats phase[LBR_PHASE_COUNT];
+};
+
+// What create and append do about inputs with the same contents as
+// another input, or as an entry already in the archive.
+enum class LbrDedup {
+	Off,
+	Report, // name each one and the entry it is the same as
+	Skip // and leave it out of the archive
+};
+
+struct LbrOptions {
+	bool verbose = false;
+	bool convert_petscii = true; // convert names between ASCII and PETSCII
+	int jobs = 1; // threads an operation may use
+	bool in_place = false; // edit archives in place rather than replacing them
+	// Entries claiming to be longer than this are treated as corrupt. 0
+	// turns the check off.
+	uint64_t max_length = 16*1024*1024;
+	std::ostream * log = nullptr; // where messages go, if anywhere
+	LbrStats * stats = nullptr; // counted into, if set
+	// Keep a parsed copy of each directory read_directory reads next to
+	// the archive, as ARCHIVE.idx, and use it while the archive is unchanged.
+	bool index_cache = false;
+	LbrDedup dedup = LbrDedup::Off;
+};
+
+// Makes opts the options of the calling thread until destroyed. Threads
+// started by the library inherit them.
+class LbrOptionsScope {
+public:
+	explicit LbrOptionsScope(const LbrOptions & opts);
+	~LbrOptionsScope();
+	LbrOptionsScope(const LbrOptionsScope &) = delete;
+	LbrOptionsScope & operator=(const LbrOptionsScope &) = delete;
+
+private:
+	const LbrOptions * saved;
+};
+
+// Options of the calling thread.
+const LbrOptions & lbr_options();
+
+enum LbrStatus {
+	LBR_OK = 0,
+	LBR_NOT_LBR, // no LBR signature
+	LBR_NOT_FOUND, // no such entry or file
+	LBR_BAD_LENGTH, // the directory has an entry with a bad length
+	LBR_READ_ERROR,
+	LBR_WRITE_ERROR,
+	LBR_INVALID, // bad argument
+	LBR_CORRUPT // the archive does not match its directory
+};
+
+const char * lbr_status_string(int status);
+
+struct FileEntry {
+	std::string name;
+	std::string ascii_name; // name as converted by petscii2ascii
+	std::string path;
+	uint64_t length = 0;
+	std::string type;
+	bool bad_length = false;
+	uint64_t dir_offset = 0; // start of the directory entry
+	uint64_t dir_length = 0; // bytes in the directory entry
+	uint64_t offset = 0; // start of the payload
+};
+
+// Directory of an archive, parsed once and shared by every operation.
+struct LbrIndex {
+	uint64_t count = 0; // entry count as given in the header
+	uint64_t dir_start = 0; // first directory entry
+	uint64_t data_start = 0; // first payload, right after the directory
+	uint64_t data_end = 0; // end of the last payload
+	bool bad_length = false; // set if any entry has a bad length
+	bool truncated = false; // set if the data ended inside the directory
+	std::vector<FileEntry> files;
+};
+
+// Name conversion, following LbrOptions::convert_petscii.
+std::string petscii2ascii(std::string_view petscii);
+std::string ascii2petscii(std::string_view ascii);
+// Orders entries by name, shorter names first, as numbers would be.
+bool num_cmp(const FileEntry & i, const FileEntry & j);
+// Sorts files into num_cmp order, faster than std::sort with it.
+void sort_numerically(std::vector<FileEntry> & files);
+// Parses a decimal number that has to fill all of str, without overflow.
+bool parse_number(std::string_view str, uint64_t & value);
+// Parses the header and directory at the start of in.
+bool parse_directory(std::string_view in, LbrIndex & index);
+// Reads the directory of an archive coming in on the pipe fd, and nothing
+// past it.
+int read_stream_directory(int fd, LbrIndex & index);
+// Reads just the header and directory of the archive at path.
+int read_directory(const std::string & path, LbrIndex & index);
+// Archives under each of roots: a directory is searched recursively for
+// *.lbr files, in sorted order, anything else is taken as an archive.
+std::vector<std::string> find_archives(const std::vector<std::string> & roots);
+// Reads the directories of all paths on up to LbrOptions::jobs threads and
+// hands each to done(i, status, index) on the calling thread, in the
+// order of paths.
+void scan_directories(const std::vector<std::string> & paths,
+	const std::function<void(size_t, int, const LbrIndex &)> & done);
+
+enum class BatchOp {
+	Delete,
+	Wipe,
+	ChangeType,
+	Append,
+	Compact, // drops deleted entries; type "padding" keeps --pad-sorted slots
+	Replace // gives an entry the contents of the file at path, typed by it
+};
+
+// One edit of a batch. target is an entry name, or a file path for Append.
+struct BatchStep {
+	BatchStep(BatchOp op = BatchOp::Delete, std::string target = "", std::string type = "")
+		: op(op), target(std::move(target)), type(std::move(type)) {}
+
+	BatchOp op;
+	std::string target;
+	std::string type;
+	std::string path; // for Replace
+	long entry = -1; // the entry at this index of the directory instead of target
+};
+
+// Reads a batch script: one step per line, as "delete NAME", "wipe NAME",
+// "type NAME:TYPE", "append PATH", "replace NAME:PATH" or "compact [padding]".
+int read_batch_script(std::string script, std::vector<BatchStep> & steps);
+
+// Operations on archives by path. file may be "-" for standard input when
+// extracting.
+int build_lbr(std::string outfile, std::vector<std::string> input,
+	bool numerical_sort, bool numerical_padding, bool strip_extension);
+int extract_lbr(std::string infile, std::string dest_folder, std::vector<std::string> targets,
+	bool skip_deleted, bool add_extension, bool to_stdout);
+int batch_lbr(std::string file, const std::vector<BatchStep> & steps, bool skip_deleted, bool strip_extension);
+int delete_lbr(std::string file, std::string target, bool skip_deleted, bool wipe);
+int chtype_lbr(std::string file, std::string target, std::string new_type, bool skip_deleted);
+int add_lbr(std::string file, std::vector<std::string> targets, bool strip_extension);
+// Brings the archive in line with the files in dir, as if built from them
+// but keeping the order of the entries already there: files it lacks are
+// appended, entries without a file wiped and entries whose type or
+// length differ from their file replaced. With compare_contents, entries
+// that look the same are compared byte by byte too. Empty deleted
+// entries are left alone. Nothing is written if nothing differs.
+int sync_lbr(std::string file, std::string dir, bool compare_contents, bool strip_extension);
+// Read one entry, found by its ASCII name, reading nothing of the archive
+// but its directory and that payload. cat_lbr writes it to standard output.
+int read_entry(std::string file, std::string target, std::string & data, bool skip_deleted = false);
+int cat_lbr(std::string file, std::string target, bool skip_deleted = false);
+
+enum class LbrChecksum {
+	None,
+	Crc32c,
+	Xxh64
+};
+
+struct LbrVerifyResult {
+	LbrIndex index;
+	std::vector<std::string> problems; // one line each, in archive order
+	std::vector<uint64_t> checksums; // of each entry before any bad length, if asked for
+};
+
+// Checks that the archive at file holds what its directory says: the
+// header and every directory entry well formed, as many entries as the
+// count, every length valid and every payload there, nothing after the
+// last one. With a checksum, also sums every payload. Returns the status
+// of the first problem.
+int verify_lbr(std::string file, LbrChecksum sum, LbrVerifyResult & result);
+
+// Builds an archive from entries added one at a time, from files on disk,
+// buffers or generators. The directory comes first and holds the final
+// count, so nothing is written out until finish(). Files are only
+// remembered by path; buffers and generated data are spooled to an
+// unlinked temporary file next to the archive. finish() then writes the
+// directory once, followed by every payload in order.
+class LbrWriter {
+public:
+	// Called for more data until it returns 0, negative on error.
+	typedef std::function<ssize_t(char * buf, size_t len)> Generator;
+
+	explicit LbrWriter(std::string outfile) : outfile(outfile) {}
+	~LbrWriter();
+	LbrWriter(const LbrWriter &) = delete;
+	LbrWriter & operator=(const LbrWriter &) = delete;
+
+	// Adds a file, named and typed after its file name like build_lbr does.
+	bool add_file(const std::string & path, bool strip_extension = false);
+	// Adds f.path with a known f.length under the name f.name.
+	bool add_file(const FileEntry & f, bool strip_extension);
+	// Adds an entry holding a copy of data. name is in ASCII.
+	bool add_buffer(const std::string & name, std::string_view data, std::string type = "S");
+	// Adds an entry with whatever gen produces. name is in ASCII.
+	bool add_generated(const std::string & name, Generator gen, std::string type = "S");
+	// Adds an empty entry marked as deleted, used as padding.
+	void add_deleted(const std::string & name);
+
+	size_t size() const { return files.size(); }
+
+	// Writes the archive and replaces outfile with it.
+	bool finish();
+
+private:
+	void add_entry(const FileEntry & f, const std::string & type);
+	bool open_spool();
+
+	std::string outfile;
+	std::string dir; // directory entries so far, without the header
+	std::vector<FileEntry> files; // empty path means the payload is in spool
+	int spool = -1;
+	uint64_t spooled = 0;
+};
+
+class LbrArchiveView;
+class LbrNameIndex;
+
+// An archive opened for reading and editing. The directory is parsed once
+// on open and after every edit; payloads are read straight out of a
+// mapping of the file.
+class LbrArchive {
+public:
+	explicit LbrArchive(const LbrOptions & opts = LbrOptions());
+	~LbrArchive();
+	LbrArchive(const LbrArchive &) = delete;
+	LbrArchive & operator=(const LbrArchive &) = delete;
+
+	int open(const std::string & path);
+	void close();
+	bool is_open() const;
+	const std::string & path() const { return file; }
+	const LbrOptions & options() const { return opts; }
+
+	const LbrIndex & index() const;
+	// Every entry, in directory order.
+	const std::vector<FileEntry> & list() const;
+	// First entry called name, in ASCII, or nullptr.
+	const FileEntry * find(const std::string & name, bool skip_deleted = false) const;
+	// Payload of f as a view into the mapping, valid until the archive is
+	// closed or changed. Cut short if the archive is truncated.
+	int read(const FileEntry & f, std::string_view & data) const;
+	int read(const std::string & name, std::string & data, bool skip_deleted = false) const;
+	int extract(const std::string & dest_folder, const std::vector<std::string> & targets,
+		bool skip_deleted = false, bool add_extension = false);
+
+	// Edits, written out at once and then opened again, or left closed
+	// without reopen.
+	int apply(const std::vector<BatchStep> & steps, bool skip_deleted = false, bool strip_extension = false,
+		bool reopen = true);
+	int remove(const std::string & name, bool skip_deleted = false);
+	int wipe(const std::string & name, bool skip_deleted = false);
+	int set_type(const std::string & name, const std::string & type, bool skip_deleted = false);
+	int append(const std::vector<std::string> & paths, bool strip_extension = false);
+	// Drops every deleted entry, but the --pad-sorted slots if keep_padding.
+	int compact(bool keep_padding = false);
+
+private:
+	LbrOptions opts;
+	std::string file;
+	std::unique_ptr<LbrArchiveView> view;
+	std::unique_ptr<LbrNameIndex> names;
+};
+
+#endif
@@ -0,0 +1,156 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// PETSCII <-> ASCII conversion of file names. Both directions map one
+// byte to one byte, so they work on preallocated or in-place buffers.
+// Note: these are very conservative conversions, anything without an
+// obvious counterpart becomes '?'. Bytes from 0x80 up always do, which is
+// what the original per-character code did with a signed char.
+
+#ifndef LBR_PETSCII_H
+#define LBR_PETSCII_H
+
+#include <array>
+#include <cstddef>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+constexpr char petscii2ascii_byte(unsigned char c) {
+	if (c < 0x20 || c >= 0x80) // ' '
+		return '?';
+	if (c >= 0x61 && c <= 0x7A)
+		return c - 0x20;
+	if (c == 0x5B || c == 0x5D)
+		return c;
+	if (c > 0x5A) // 'Z'
+		return '?';
+	return c;
+}
+
+constexpr char ascii2petscii_byte(unsigned char c) {
+	if (c < 0x20 || c >= 0x80) // ' '
+		return '?';
+	if (c == 0x5C) // backslash
+		return '/';
+	if (c == 0x5F) // under_score
+		return ' ';
+	if (c == 0x60) // backtick
+		return 0x27; // apostrophe
+	if (c >= 0x61 && c <= 0x7A) // lower case
+		return c - 0x20;
+	if (c == 0x7B) // curly open
+		return '(';
+	if (c == 0x7D) // curly close
+		return ')';
+	if (c == 0x7C) // pipe
+		return '/';
+	if (c > 0x7C)
+		return '?';
+	return c;
+}
+
+template <char (*F)(unsigned char)>
+constexpr std::array<char, 256> make_conversion_table() {
+	std::array<char, 256> table{};
+	for (int i = 0; i < 256; ++i)
+		table[i] = F(i);
+	return table;
+}
+
+constexpr std::array<char, 256> petscii2ascii_table = make_conversion_table<petscii2ascii_byte>();
+constexpr std::array<char, 256> ascii2petscii_table = make_conversion_table<ascii2petscii_byte>();
+
+// Names at least this long go through the vector kernels.
+const size_t PETSCII_SIMD_MIN = 16;
+
+#ifdef __SSE2__
+// Picks b where mask is set, a elsewhere.
+static inline __m128i petscii_select(__m128i mask, __m128i b, __m128i a) {
+	return _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, a));
+}
+
+// 16 bytes at a time. The compares are signed, so bytes from 0x80 up
+// count as negative and fall out of every range below.
+static inline size_t petscii2ascii_sse2(const char * in, size_t len, char * out) {
+	const __m128i question = _mm_set1_epi8('?');
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+		__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(0x60)),
+			_mm_cmplt_epi8(c, _mm_set1_epi8(0x7B)));
+		__m128i keep = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(0x1F)),
+			_mm_cmplt_epi8(c, _mm_set1_epi8(0x5B)));
+		keep = _mm_or_si128(keep, _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(0x5B)),
+			_mm_cmpeq_epi8(c, _mm_set1_epi8(0x5D))));
+		__m128i r = petscii_select(keep, c, question);
+		r = petscii_select(lower, _mm_sub_epi8(c, case_bit), r);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), r);
+	}
+	return i;
+}
+
+static inline size_t ascii2petscii_sse2(const char * in, size_t len, char * out) {
+	const __m128i question = _mm_set1_epi8('?');
+	const __m128i slash = _mm_set1_epi8('/');
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+		__m128i r = c;
+		__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(0x60)),
+			_mm_cmplt_epi8(c, _mm_set1_epi8(0x7B)));
+		r = petscii_select(lower, _mm_sub_epi8(c, _mm_set1_epi8(0x20)), r);
+		r = petscii_select(_mm_cmpeq_epi8(c, _mm_set1_epi8(0x5C)), slash, r);
+		r = petscii_select(_mm_cmpeq_epi8(c, _mm_set1_epi8(0x7C)), slash, r);
+		r = petscii_select(_mm_cmpeq_epi8(c, _mm_set1_epi8(0x5F)), _mm_set1_epi8(' '), r);
+		r = petscii_select(_mm_cmpeq_epi8(c, _mm_set1_epi8(0x60)), _mm_set1_epi8(0x27), r);
+		r = petscii_select(_mm_cmpeq_epi8(c, _mm_set1_epi8(0x7B)), _mm_set1_epi8('('), r);
+		r = petscii_select(_mm_cmpeq_epi8(c, _mm_set1_epi8(0x7D)), _mm_set1_epi8(')'), r);
+		__m128i bad = _mm_or_si128(_mm_cmplt_epi8(c, _mm_set1_epi8(0x20)),
+			_mm_cmpgt_epi8(c, _mm_set1_epi8(0x7D)));
+		r = petscii_select(bad, question, r);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), r);
+	}
+	return i;
+}
+#endif
+
+// Converts len bytes from in to out, which may be the same buffer.
+static inline void petscii2ascii(const char * in, size_t len, char * out) {
+	size_t i = 0;
+#ifdef __SSE2__
+	if (len >= PETSCII_SIMD_MIN)
+		i = petscii2ascii_sse2(in, len, out);
+#endif
+	for (; i < len; ++i)
+		out[i] = petscii2ascii_table[static_cast<unsigned char>(in[i])];
+}
+
+static inline void ascii2petscii(const char * in, size_t len, char * out) {
+	size_t i = 0;
+#ifdef __SSE2__
+	if (len >= PETSCII_SIMD_MIN)
+		i = ascii2petscii_sse2(in, len, out);
+#endif
+	for (; i < len; ++i)
+		out[i] = ascii2petscii_table[static_cast<unsigned char>(in[i])];
+}
+
+#endif
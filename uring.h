@@ -0,0 +1,179 @@
+/*
+   LBR Tool -- Build and extract from C64 LBR archives
+
+   Copyright 2020 Talas (talas.pw)
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A minimal io_uring ring on the raw system calls, for handing the kernel
+// a batch of opens, reads, writes or closes at once instead of making one
+// call for each. Requests are queued, then run() submits them all and
+// waits until every one has completed. Only built with LBR_IO_URING.
+
+#ifndef LBR_URING_H
+#define LBR_URING_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+class IoRing {
+public:
+	IoRing() = default;
+	IoRing(const IoRing &) = delete;
+	IoRing & operator=(const IoRing &) = delete;
+	~IoRing() {
+		if (sqes) munmap(sqes, sqes_size);
+		if (cq_map && cq_map != sq_map) munmap(cq_map, cq_size);
+		if (sq_map) munmap(sq_map, sq_size);
+		if (ring >= 0) ::close(ring);
+	}
+
+	// Sets up a ring for up to entries requests at a time. Returns false
+	// when the kernel has no io_uring or it is not allowed here.
+	bool init(unsigned entries) {
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		ring = syscall(__NR_io_uring_setup, entries, &p);
+		if (ring < 0) return false;
+		sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+		if (single && cq_size > sq_size) sq_size = cq_size;
+		sq_map = map(sq_size, IORING_OFF_SQ_RING);
+		if (!sq_map) return false;
+		cq_map = single ? sq_map : map(cq_size, IORING_OFF_CQ_RING);
+		if (!cq_map) return false;
+		sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = static_cast<struct io_uring_sqe *>(map(sqes_size, IORING_OFF_SQES));
+		if (!sqes) return false;
+		char * sq = static_cast<char *>(sq_map);
+		char * cq = static_cast<char *>(cq_map);
+		sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+		sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+		sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+		cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+		cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+		cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+		slots = p.sq_entries;
+		return true;
+	}
+
+	// Requests that can be queued before run() has to be called.
+	unsigned capacity() const { return slots - queued; }
+
+	// Queue one request each, false when the ring is full. tag is handed
+	// back with the result.
+	bool openat(const char * path, int flags, mode_t mode, uint64_t tag) {
+		struct io_uring_sqe * sqe = next(IORING_OP_OPENAT, AT_FDCWD, tag);
+		if (!sqe) return false;
+		sqe->addr = reinterpret_cast<uintptr_t>(path);
+		sqe->len = mode;
+		sqe->open_flags = flags;
+		return true;
+	}
+	bool read(int fd, void * buf, unsigned len, uint64_t offset, uint64_t tag) {
+		struct io_uring_sqe * sqe = next(IORING_OP_READ, fd, tag);
+		if (!sqe) return false;
+		sqe->addr = reinterpret_cast<uintptr_t>(buf);
+		sqe->len = len;
+		sqe->off = offset;
+		return true;
+	}
+	bool write(int fd, const void * buf, unsigned len, uint64_t offset, uint64_t tag) {
+		struct io_uring_sqe * sqe = next(IORING_OP_WRITE, fd, tag);
+		if (!sqe) return false;
+		sqe->addr = reinterpret_cast<uintptr_t>(buf);
+		sqe->len = len;
+		sqe->off = offset;
+		return true;
+	}
+	bool close(int fd, uint64_t tag) {
+		return next(IORING_OP_CLOSE, fd, tag) != nullptr;
+	}
+
+	// Submits everything queued and waits for all of it, calling
+	// done(tag, result) for each request, result being what the system
+	// call would have returned or -errno. Returns false if the ring itself
+	// failed, in which case not every request may have been run.
+	bool run(const std::function<void(uint64_t, int)> & done) {
+		unsigned pending = queued;
+		unsigned to_submit = queued;
+		queued = 0;
+		while (pending > 0) {
+			int n = syscall(__NR_io_uring_enter, ring, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+				return false;
+			}
+			to_submit -= n;
+			unsigned head = *cq_head;
+			unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head, --pending) {
+				const struct io_uring_cqe & cqe = cqes[head & cq_mask];
+				done(cqe.user_data, cqe.res);
+			}
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		}
+		return true;
+	}
+
+private:
+	void * map(size_t size, off_t offset) {
+		void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, offset);
+		return p == MAP_FAILED ? nullptr : p;
+	}
+
+	struct io_uring_sqe * next(int op, int fd, uint64_t tag) {
+		if (queued >= slots) return nullptr;
+		unsigned tail = *sq_tail;
+		unsigned i = tail & sq_mask;
+		struct io_uring_sqe * sqe = &sqes[i];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = op;
+		sqe->fd = fd;
+		sqe->user_data = tag;
+		sq_array[i] = i;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++queued;
+		return sqe;
+	}
+
+	int ring = -1;
+	void * sq_map = nullptr;
+	void * cq_map = nullptr;
+	size_t sq_size = 0;
+	size_t cq_size = 0;
+	struct io_uring_sqe * sqes = nullptr;
+	size_t sqes_size = 0;
+	unsigned * sq_tail = nullptr;
+	unsigned * sq_array = nullptr;
+	unsigned sq_mask = 0;
+	unsigned * cq_head = nullptr;
+	unsigned * cq_tail = nullptr;
+	unsigned cq_mask = 0;
+	struct io_uring_cqe * cqes = nullptr;
+	unsigned slots = 0;
+	unsigned queued = 0;
+};
+
+#endif